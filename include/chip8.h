@@ -1,12 +1,8 @@
 #ifndef CHIP8_H
 #define CHIP8_H
 
-#ifndef __LIBRETRO__
-#ifdef WIN32
+#if !defined(__LIBRETRO__) && defined(WIN32)
 #include <windows.h>
-#else
-#include <sys/time.h>
-#endif
 #endif
 #if defined(_MSC_VER) && _MSC_VER < 1800
 #ifdef __LIBRETRO__
@@ -21,10 +17,17 @@
 #endif
 #include <stdint.h>
 
-#define ONE_SEC 1000000
+#define ONE_SEC 1000000000LL // Nanoseconds
 
 #define DISPLAY_WIDTH 128
 #define DISPLAY_HEIGHT 64
+#define DISPLAY_ROW_WORDS (DISPLAY_WIDTH / 64)
+
+// Every row of the display in a dirty row bitmap.
+#define DISPLAY_ALL_ROWS UINT64_MAX
+
+// The bit of its row word that holds the pixel in column x.
+#define CHIP8_PIXEL_BIT(x) (1ULL << (63 - ((x) % 64)))
 
 #define NUM_KEYS 16
 #define NUM_REGISTERS 16
@@ -38,6 +41,8 @@
 #define MAX_FILEPATH_LEN 256
 #define STACK_SIZE 16
 #define AUDIO_BUF_SIZE 16
+#define CODE_PAGE_SIZE 64
+#define NUM_CODE_PAGES (MAX_RAM / CODE_PAGE_SIZE)
 
 #define FONT_START_ADDR 0x0
 #define BIG_FONT_START_ADDR (FONT_START_ADDR + NUM_FONT_BYTES)
@@ -49,6 +54,9 @@
 #define REFRESH_FREQ_DEFAULT 60
 #define TIMER_FREQ_DEFAULT 60
 #define PITCH_DEFAULT 64
+#define CALIBRATION_TIME_DEFAULT 0.25 // Seconds
+#define CALIBRATION_HEADROOM_DEFAULT 0.5 // Share of each frame left spare
+#define CALIBRATION_FRAME_CYCLES 1000
 
 // The states each key of the keypad can be in.
 typedef enum
@@ -67,6 +75,36 @@ typedef enum
     BPBOTH
 } CHIP8BP;
 
+struct CHIP8;
+
+// An instruction that has already been fetched and decoded.
+typedef struct CHIP8_INSTR
+{
+    // Executes the instruction (NULL if the entry has not been decoded yet).
+    void (*handler)(struct CHIP8 *chip8, const struct CHIP8_INSTR *instr);
+
+    // The operands of the instruction.
+    uint16_t nnn;
+    uint8_t n, x, y, kk;
+
+    // Identifies the handler, used for threaded dispatch.
+    uint8_t op;
+
+    // Number of instructions left in its basic block, including this one.
+    uint8_t len;
+} CHIP8_INSTR;
+
+/* Predecoded instructions, one for every (even or odd) address in RAM.
+Basic blocks never cross a code page, so writing to RAM only has to discard
+the pages that were written. */
+typedef struct CHIP8_ICACHE
+{
+    CHIP8_INSTR instr[MAX_RAM];
+
+    // Whether any instruction of the page has been decoded.
+    bool page_used[NUM_CODE_PAGES];
+} CHIP8_ICACHE;
+
 typedef struct CHIP8
 {
     // Represents random-access memory.
@@ -78,17 +116,25 @@ typedef struct CHIP8
     // Program counter, stack pointer, and index 16-bit registers.
     uint16_t PC, SP, I;
 
-    // Delay timer and sound timer 8-bit registers.
+    /* Delay timer and sound timer 8-bit registers, as of the last
+    chip8_sync_timers (see timer_cum). */
     uint8_t DT, ST;
 
     // 8-bit register which controls audio pitch (XO-CHIP Only).
     uint8_t pitch;
 
-    // A monochrome display. A pixel can be either only on or off, no color.
-    bool display[DISPLAY_HEIGHT][DISPLAY_WIDTH];
+    // State of the random number generator used by RND.
+    uint32_t rng;
+
+    /* A monochrome display. A pixel can be either only on or off, no color.
+    Every row is packed into 64-bit words, pixel x being CHIP8_PIXEL_BIT(x) of
+    word x / 64. While native_lores is set the planes hold a 64x32 image in the
+    first word of their first 32 rows instead. Use chip8_get_pixel or
+    chip8_get_display_row to read them at display resolution. */
+    uint64_t display[DISPLAY_HEIGHT][DISPLAY_ROW_WORDS];
 
     // A second display for XO-CHIP support.
-    bool display2[DISPLAY_HEIGHT][DISPLAY_WIDTH];
+    uint64_t display2[DISPLAY_HEIGHT][DISPLAY_ROW_WORDS];
 
     // Represents the bitmask of both displays.
     CHIP8BP bitplane;
@@ -103,14 +149,26 @@ typedef struct CHIP8
     unsigned long cpu_freq;
     unsigned long timer_freq;
     unsigned long refresh_freq;
-    long timer_max_cum;
-    long cpu_max_cum;
-    long cpu_cum;
-    long sound_cum;
-    long delay_cum;
-    long refresh_max_cum;
-    long refresh_cum;
-    long total_cycle_time;
+
+    /* Instructions per frame in IPF mode (like Octo), or 0 to run cpu_freq
+    instructions per second. */
+    unsigned long ipf;
+
+    // Instructions per second carried over to the next frame.
+    unsigned long cpu_debt;
+
+    /* Idle loop instructions chip8_run skipped instead of executing since the
+    last reset. They are still part of what it returns. */
+    unsigned long skipped_cycles;
+
+    // All in nanoseconds.
+    int64_t timer_max_cum;
+    int64_t cpu_max_cum;
+    int64_t cpu_cum;
+    int64_t timer_cum; // Time the timers have run since they were last synced
+    int64_t refresh_max_cum;
+    int64_t refresh_cum;
+    int64_t total_cycle_time;
 
 #ifndef __LIBRETRO__
 #ifdef WIN32
@@ -119,8 +177,9 @@ typedef struct CHIP8
     LARGE_INTEGER prev_cycle_start;
     LARGE_INTEGER real_cpu_freq;
 #else
-    struct timeval cur_cycle_start;
-    struct timeval prev_cycle_start;
+    // Readings of the monotonic clock, in nanoseconds.
+    int64_t cur_cycle_start;
+    int64_t prev_cycle_start;
 #endif
 #endif
 
@@ -151,7 +210,14 @@ typedef struct CHIP8
     // Used to signal to main to update the display.
     bool display_updated;
 
-    // Used to signal to main to produce sound.
+    // Set by instructions that change the display (cleared by chip8_run).
+    bool display_changed;
+
+    /* Rows of the display changed since the frontend last repainted it, bit y
+    standing for row y. See chip8_get_dirty_rows. */
+    uint64_t dirty_rows;
+
+    // Used to signal to main to produce sound (see chip8_sync_timers).
     bool beep;
 
     // Used to signal to main to exit the program.
@@ -159,19 +225,61 @@ typedef struct CHIP8
 
     // Used to toggle between HI-RES and standard LO-RES modes.
     bool hires;
+
+    /* Set while the displays hold a native 64x32 lores image. The core switches
+    to it whenever the lores image allows, and back when it does not. */
+    bool native_lores;
+
+    /* Set while Fx0A is waiting for a key to be released. The CPU sleeps
+    until then, but timers keep running. */
+    bool waiting;
+
+    /* Set once the program halts (0000) or jumps to itself, after which only
+    the timers can change. Cleared by a reset. */
+    bool halted;
+
+    // Set on the copy run by chip8_calibrate, which must not save user flags.
+    bool calibrating;
+
+    /* Instruction cache allocated by chip8_init and shared by copies of the
+    struct. */
+    CHIP8_ICACHE *icache;
 } CHIP8;
 
-// Set some things to useful default values.
+// How fast the host runs a program, as measured by chip8_calibrate.
+typedef struct
+{
+    unsigned long instructions; // Instructions executed while measuring
+    double seconds;             // Wall time they took
+    double instructions_per_sec;
+
+    // The fastest speed leaving the requested headroom in every frame.
+    unsigned long cpu_freq;
+    unsigned long ipf;
+
+    // Wall time each frame takes at that speed, in seconds.
+    double frame_time;
+} CHIP8_CALIBRATION;
+
+/* Set some things to useful default values. The struct must be zeroed before
+the first call (e.g. by being declared static). */
 void chip8_init(CHIP8 *chip8, unsigned long cpu_freq, unsigned long timer_freq,
                 unsigned long refresh_freq, uint16_t pc_start_addr,
                 bool quirks[]);
 
+// Frees the resources allocated by chip8_init.
+void chip8_deinit(CHIP8 *chip8);
+
 // Reset the machine.
 void chip8_reset(CHIP8 *chip8);
 
 // Soft reset the machine (keep ROM and fonts loaded).
 void chip8_soft_reset(CHIP8 *chip8);
 
+/* Seeds the random number generator used by RND. chip8_init seeds it with the
+current time. */
+void chip8_seed(CHIP8 *chip8, uint32_t seed);
+
 // Sets the CPU frequency of the machine.
 void chip8_set_cpu_freq(CHIP8 *chip8, unsigned long cpu_freq);
 
@@ -181,6 +289,16 @@ void chip8_set_timer_freq(CHIP8 *chip8, unsigned long timer_freq);
 // Sets the refresh frequency of the machine.
 void chip8_set_refresh_freq(CHIP8 *chip8, unsigned long refresh_freq);
 
+/* Sets the number of instructions per frame, switching to IPF mode (or out of
+it with 0). Frames then run at the refresh frequency and tick the timers once,
+whatever cpu_freq and timer_freq are. */
+void chip8_set_ipf(CHIP8 *chip8, unsigned long ipf);
+
+/* Enables or disables one of the quirks. Instructions are specialized for the
+quirks when they are decoded, so use this instead of changing quirks directly
+once a program has started. */
+void chip8_set_quirk(CHIP8 *chip8, int quirk, bool enabled);
+
 // Load hexadecimal font into memory.
 void chip8_load_font(CHIP8 *chip8);
 
@@ -192,18 +310,71 @@ void chip8_load_rom_buffer(CHIP8 *chip8, const void *raw, size_t sz);
   
 /* Performs a full cycle of the emulator including executing an instruction and
 handling timers. Returns true if instruction was executed
-or false if the CPU was sleeping. */
+or false if the CPU was sleeping, waiting for a key or halted. */
 bool chip8_cycle(CHIP8 *chip8);
 
-// Fetches, decodes, and executes the next instruction.
+/* Executes up to n instructions without handling timers, which the caller
+advances once for the whole batch. Stops early when the program exits, halts or
+waits for a key, and after any instruction that changes the display if
+stop_on_draw is set. Returns the number of instructions executed, including
+those of idle loops it skipped (see skipped_cycles). */
+int chip8_run(CHIP8 *chip8, int n, bool stop_on_draw);
+
+/* Returns the number of instructions in the next frame: ipf in IPF mode,
+otherwise cpu_freq / refresh_freq with the remainder carried over to later
+frames (0 if refresh_freq is 0). */
+unsigned long chip8_frame_cycles(CHIP8 *chip8);
+
+/* Runs a frame of n instructions (see chip8_frame_cycles) and advances the
+timers by the frame, even if the CPU stopped early. Outside of IPF mode the
+timers only advance if cpu_freq is not 0. Returns the number of instructions
+executed. */
+int chip8_run_frame(CHIP8 *chip8, unsigned long n);
+
+/* Runs a copy of the emulator as fast as possible for about the given wall
+time, blocking the caller meanwhile, then works out the highest CPU frequency
+(and IPF) at which frames only use 1 - headroom of their time at the refresh
+frequency. Keys are released whenever the program waits for one. The emulator
+itself is left untouched. Returns false if nothing could be measured, e.g. if
+the program stopped. */
+bool chip8_calibrate(CHIP8 *chip8, double seconds, double headroom,
+                     CHIP8_CALIBRATION *calibration);
+
+/* Executes the next instruction, fetching and decoding it first if it is not
+in the instruction cache yet. */
 void chip8_execute(CHIP8 *chip8);
 
-// Decrements delay and sound timers at specified frequency.
+/* Executes up to max instructions of the basic block at PC (a straight run of
+instructions ending at a jump, call, return, skip, key wait or an instruction
+that changes the display). When the whole block runs, flags and collisions that
+a later instruction of the block overwrites are not computed, and a draw whose
+collisions are skipped that way does not end the block.
+Returns the number of instructions executed. */
+int chip8_execute_block(CHIP8 *chip8, int max);
+
+/* Discards the predecoded instructions overlapping len bytes of RAM starting
+at addr. Must be called after writing to RAM from outside of the emulator. */
+void chip8_invalidate_code(CHIP8 *chip8, int addr, int len);
+
+/* Returns true if Fx0A is waiting for a key and none has been released yet, so
+nothing but the timers can change. */
+bool chip8_is_waiting(CHIP8 *chip8);
+
+/* Advances the delay and sound timers and the display refresh by
+total_cycle_time. The timers are only counted here, see chip8_sync_timers. */
 void chip8_handle_timers(CHIP8 *chip8);
 
+/* Applies the timer ticks counted since the last call to DT and ST and updates
+beep. Call it before reading any of them from outside the emulator. */
+void chip8_sync_timers(CHIP8 *chip8);
+
 // Updates the total cycle time since last call.
 void chip8_update_elapsed_time(CHIP8 *chip8);
 
+/* Starts timing from now, e.g. after restoring a state saved at another time,
+so the next chip8_update_elapsed_time does not count the time in between. */
+void chip8_reset_clock(CHIP8 *chip8);
+
 // Clears the keypad by setting all keys to up.
 void chip8_reset_keypad(CHIP8 *chip8);
 
@@ -213,6 +384,29 @@ void chip8_reset_released_keys(CHIP8 *chip8);
 // Clears the display by setting all pixels to off.
 void chip8_reset_display(CHIP8 *chip8, CHIP8BP bitplane);
 
+// Returns true if the pixel is on in any of the given bitplanes.
+bool chip8_get_pixel(CHIP8 *chip8, CHIP8BP bitplane, int x, int y);
+
+/* Gets row y of the given bitplanes at display resolution (ORed together for
+BPBOTH), upscaling a native lores image. */
+void chip8_get_display_row(CHIP8 *chip8, CHIP8BP bitplane, int y,
+                           uint64_t row[DISPLAY_ROW_WORDS]);
+
+// Turns a pixel of the given bitplanes on or off.
+void chip8_set_pixel(CHIP8 *chip8, CHIP8BP bitplane, int x, int y, bool on);
+
+/* Returns the rows of the display that changed since the last call to
+chip8_clear_dirty_rows, bit y standing for row y. Frontends only need to repaint
+these rows. */
+uint64_t chip8_get_dirty_rows(CHIP8 *chip8);
+
+// Marks every row of the display as repainted.
+void chip8_clear_dirty_rows(CHIP8 *chip8);
+
+/* Marks every row of the display as changed, e.g. after restoring a saved
+state or changing the colors. */
+void chip8_invalidate_display(CHIP8 *chip8);
+
 // Clears the RAM.
 void chip8_reset_RAM(CHIP8 *chip8);
 
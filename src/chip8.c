@@ -1,16 +1,83 @@
+// For clock_gettime when building with -std=c99.
+#define _POSIX_C_SOURCE 199309L
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <math.h>
+#ifdef WIN32
+#include <windows.h>
+#endif
 #include "chip8.h"
 
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#endif
+
+/* Blocks are executed with computed gotos where the compiler supports them,
+otherwise (MSVC, libretro builds) with a plain loop over handler pointers. */
+#if defined(__GNUC__) && !defined(__LIBRETRO__) && !defined(CHIP8_NO_THREADED_DISPATCH)
+#define CHIP8_THREADED_DISPATCH
+#endif
+
+#if defined(__GNUC__)
+#define CHIP8_ALWAYS_INLINE inline __attribute__((always_inline))
+#elif defined(_MSC_VER)
+#define CHIP8_ALWAYS_INLINE __forceinline
+#else
+#define CHIP8_ALWAYS_INLINE inline
+#endif
+
+/* Common quirk profiles that get their own draw routine: S-CHIP (default),
+legacy (-l) and XO-CHIP (-x), with their values of quirks 4, 6, 7 and 8.
+Any other combination uses the generic chip8_draw. */
+#define CHIP8_DRAW_PROFILES(X)                \
+    X(schip, true, true, true, true)          \
+    X(legacy, false, true, false, false)      \
+    X(xochip, false, false, false, false)
+
+#define CHIP8_DRAW_DECLARE(name, q4, q6, q7, q8)                        \
+    static void chip8_draw_##name(CHIP8 *chip8, uint8_t x, uint8_t y,   \
+                                  uint8_t n, CHIP8BP bitplane);         \
+    static void chip8_draw_##name##_no_vf(CHIP8 *chip8, uint8_t x,      \
+                                          uint8_t y, uint8_t n,         \
+                                          CHIP8BP bitplane);
+
+CHIP8_DRAW_PROFILES(CHIP8_DRAW_DECLARE)
+
+static void chip8_draw_no_vf(CHIP8 *chip8, uint8_t x, uint8_t y, uint8_t n,
+                             CHIP8BP bitplane);
+static void chip8_expand_lores(CHIP8 *chip8);
+static void chip8_pack_lores(CHIP8 *chip8);
+
+/* Returns the time of the monotonic clock in nanoseconds, or the processor time
+used where there is no such clock. */
+static int64_t chip8_clock_ns(void)
+{
+#if defined(WIN32)
+    LARGE_INTEGER freq, now;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&now);
+    return now.QuadPart / freq.QuadPart * ONE_SEC +
+           now.QuadPart % freq.QuadPart * ONE_SEC / freq.QuadPart;
+#elif defined(CLOCK_MONOTONIC)
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * ONE_SEC + now.tv_nsec;
+#else
+    return (int64_t)clock() * ONE_SEC / CLOCKS_PER_SEC;
+#endif
+}
+
 void chip8_init(CHIP8 *chip8, unsigned long cpu_freq, unsigned long timer_freq,
                 unsigned long refresh_freq, uint16_t pc_start_addr,
                 bool quirks[])
 {
     // Seed for the RND instruction.
-    srand(time(NULL));
+    chip8_seed(chip8, (uint32_t)time(NULL));
 
     for (int i = 0; i < NUM_QUIRKS; i++)
     {
@@ -20,13 +87,30 @@ void chip8_init(CHIP8 *chip8, unsigned long cpu_freq, unsigned long timer_freq,
     chip8_set_cpu_freq(chip8, cpu_freq);
     chip8_set_timer_freq(chip8, timer_freq);
     chip8_set_refresh_freq(chip8, refresh_freq);
+    chip8_set_ipf(chip8, 0);
 
     chip8->pc_start_addr = pc_start_addr;
     chip8->bitplane = BP1;
 
+    /* Without the instruction cache every instruction is simply decoded
+    each time it executes. */
+    if (!chip8->icache)
+    {
+        chip8->icache = calloc(1, sizeof(CHIP8_ICACHE));
+    }
+
+    // Cached instructions may have been specialized for the old quirks.
+    chip8_invalidate_code(chip8, 0, MAX_RAM);
+
     chip8_reset(chip8);
 }
 
+void chip8_deinit(CHIP8 *chip8)
+{
+    free(chip8->icache);
+    chip8->icache = NULL;
+}
+
 void chip8_reset(CHIP8 *chip8)
 {
     chip8->PC = chip8->pc_start_addr;
@@ -36,26 +120,24 @@ void chip8_reset(CHIP8 *chip8)
     chip8->ST = 0;
     chip8->pitch = PITCH_DEFAULT;
 
-// Have cycle times default to current time.
-#ifndef __LIBRETRO__
-#ifdef WIN32
-    QueryPerformanceFrequency(&chip8->real_cpu_freq);
-    QueryPerformanceCounter(&chip8->cur_cycle_start);
-    QueryPerformanceCounter(&chip8->prev_cycle_start);
-#else
-    gettimeofday(&chip8->cur_cycle_start, NULL);
-    gettimeofday(&chip8->prev_cycle_start, NULL);
-#endif
-#endif
+    // Have cycle times default to current time.
+    chip8_reset_clock(chip8);
 
     chip8->cpu_cum = 0;
-    chip8->sound_cum = 0;
-    chip8->delay_cum = 0;
+    chip8->timer_cum = 0;
+    chip8->refresh_cum = 0;
+    chip8->cpu_debt = 0;
+    chip8->skipped_cycles = 0;
 
     chip8->display_updated = false;
+    chip8->display_changed = false;
+    chip8->dirty_rows = DISPLAY_ALL_ROWS;
     chip8->beep = false;
     chip8->exit = false;
     chip8->hires = false;
+    chip8->waiting = false;
+    chip8->halted = false;
+    chip8->calibrating = false;
     chip8->bitplane = BP1;
 
     chip8->ROM_path[0] = '\0';
@@ -116,6 +198,38 @@ void chip8_set_refresh_freq(CHIP8 *chip8, unsigned long refresh_freq)
     }
 }
 
+void chip8_set_ipf(CHIP8 *chip8, unsigned long ipf)
+{
+    chip8->ipf = ipf;
+    chip8->cpu_debt = 0;
+}
+
+void chip8_seed(CHIP8 *chip8, uint32_t seed)
+{
+    // Xorshift gets stuck on a state of zero.
+    chip8->rng = seed ? seed : 0x2545F491;
+}
+
+// Returns the next random byte (xorshift32).
+static uint8_t chip8_rand(CHIP8 *chip8)
+{
+    uint32_t r = chip8->rng;
+    r ^= r << 13;
+    r ^= r >> 17;
+    r ^= r << 5;
+    chip8->rng = r;
+
+    return r >> 24;
+}
+
+void chip8_set_quirk(CHIP8 *chip8, int quirk, bool enabled)
+{
+    chip8->quirks[quirk] = enabled;
+
+    // Cached instructions may have been specialized for the old value.
+    chip8_invalidate_code(chip8, 0, MAX_RAM);
+}
+
 void chip8_load_font(CHIP8 *chip8)
 {
     /* Characters are represented in memory as 5 bytes
@@ -166,6 +280,8 @@ void chip8_load_font(CHIP8 *chip8)
     {
         chip8->RAM[FONT_START_ADDR + i] = font_data[i];
     }
+
+    chip8_invalidate_code(chip8, FONT_START_ADDR, sizeof(font_data));
 }
 
 #ifndef __LIBRETRO__
@@ -180,6 +296,9 @@ bool chip8_load_rom(CHIP8 *chip8, char *filename)
 
         fclose(rom);
 
+        chip8_invalidate_code(chip8, chip8->pc_start_addr,
+                              MAX_RAM - chip8->pc_start_addr);
+
         snprintf(chip8->ROM_path, sizeof(chip8->ROM_path) - 1, "%s", filename);
         snprintf(chip8->UF_path, sizeof(chip8->UF_path) - 1, "%s.uf", filename);
         snprintf(chip8->DMP_path, sizeof(chip8->DMP_path) - 1, "%s.dmp", filename);
@@ -196,12 +315,39 @@ void chip8_load_rom_buffer(CHIP8 *chip8, const void *raw, size_t sz) {
     size_t maxsz = MAX_RAM - chip8->pc_start_addr;
     size_t realsz = maxsz < sz ? maxsz : sz;
     memcpy(chip8->RAM + chip8->pc_start_addr, raw, realsz);
+    chip8_invalidate_code(chip8, chip8->pc_start_addr, realsz);
 
     chip8->ROM_path[0] = '\0';
     chip8->UF_path[0] = '\0';
     chip8->DMP_path[0] = '\0';
 }
 
+bool chip8_is_waiting(CHIP8 *chip8)
+{
+    if (!chip8->waiting)
+    {
+        return false;
+    }
+
+    for (int k = 0; k < NUM_KEYS; k++)
+    {
+        if (chip8->keypad[k] == KEY_RELEASED)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/* Returns what is left of accumulated time once the events it covered were
+handled. Only a fraction of a period is kept, so a late caller does not try to
+catch up on every event it missed. */
+static int64_t chip8_carry_time(int64_t cum, int64_t period)
+{
+    return (period > 0) ? cum % period : 0;
+}
+
 bool chip8_cycle(CHIP8 *chip8)
 {
     bool executed = false;
@@ -211,685 +357,1757 @@ bool chip8_cycle(CHIP8 *chip8)
     chip8->cpu_cum += chip8->total_cycle_time;
     if (!chip8->cpu_freq || chip8->cpu_cum >= chip8->cpu_max_cum)
     {
-        chip8->cpu_cum = 0;
-        chip8_execute(chip8);
-        executed = true;
+        chip8->cpu_cum = chip8_carry_time(chip8->cpu_cum, chip8->cpu_max_cum);
+
+        // Fx0A runs again to take the key once one is released.
+        if (!chip8->halted && !chip8_is_waiting(chip8))
+        {
+            chip8_execute(chip8);
+            executed = true;
+        }
     }
 
     chip8_handle_timers(chip8);
     return executed;
 }
 
-void chip8_execute(CHIP8 *chip8)
+/* Returns true if PC is at a delay timer wait loop (Fx07, then 3xkk or 4xkk
+on the same register, then a jump back to the Fx07) which would only repeat
+itself until DT changes. */
+static bool chip8_is_idle_loop(CHIP8 *chip8)
 {
-    /* Fetch */
-    // The first and second byte of instruction respectively.
-    uint8_t b1 = chip8->RAM[chip8->PC],
-            b2 = chip8->RAM[chip8->PC + 1];
+    uint8_t code[6];
+    for (int i = 0; i < 6; i++)
+    {
+        code[i] = chip8->RAM[(uint16_t)(chip8->PC + i)];
+    }
 
-    /* Decode */
-    // The code (first 4 bits) of instruction.
-    uint8_t c = b1 >> 4;
+    uint8_t x = code[0] & 0x0F;
+    uint16_t target = ((code[4] & 0x0F) << 8) | code[5];
 
-    // The last 12 bits of instruction.
-    uint16_t nnn = ((b1 & 0xF) << 8) | b2;
+    if ((code[0] & 0xF0) != 0xF0 || code[1] != 0x07 ||
+        (code[4] & 0xF0) != 0x10 || target != chip8->PC)
+    {
+        return false;
+    }
 
-    // The last 4 bits of instruction.
-    uint8_t n = b2 & 0xF;
+    // The loop must not have read DT for the first time or be about to exit.
+    if (chip8->V[x] != chip8->DT)
+    {
+        return false;
+    }
 
-    // The last 4 bits of first byte of instruction.
-    uint8_t x = b1 & 0xF;
+    if (code[2] == (0x30 | x))
+    {
+        if (chip8->DT == code[3])
+        {
+            return false;
+        }
+    }
+    else if (code[2] == (0x40 | x))
+    {
+        if (chip8->DT != code[3])
+        {
+            return false;
+        }
+    }
+    else
+    {
+        return false;
+    }
 
-    // The first 4 bits of second byte of instruction.
-    uint8_t y = b2 >> 4;
+    // A released key would still be cleared by the next iteration.
+    for (int k = 0; k < NUM_KEYS; k++)
+    {
+        if (chip8->keypad[k] == KEY_RELEASED)
+        {
+            return false;
+        }
+    }
 
-    // The last 8 bits of instruction.
-    uint8_t kk = b2;
+    return true;
+}
 
-    /* Immediately set PC to next instruction
-    after fetching and decoding the current one. */
-    chip8->PC += 2;
+int chip8_run(CHIP8 *chip8, int n, bool stop_on_draw)
+{
+    int executed = 0;
+    chip8->display_changed = false;
 
-    /* Execute */
-    switch (c)
+    // Idle loops are spotted from the value of DT.
+    chip8_sync_timers(chip8);
+
+    while (executed < n && !chip8->exit && !chip8->halted &&
+           !chip8_is_waiting(chip8))
     {
-    case 0x00:
-        switch (b2)
+        /* Timers are only advanced between batches, so the rest of the batch
+        would spin in the idle loop. Skip its whole iterations, unless the
+        point is to measure how fast instructions run. */
+        if (!chip8->calibrating && chip8_is_idle_loop(chip8))
         {
-        /* HALT (0000)
-           Halt the emulator. */
-        case 0x00:
-            chip8->PC -= 2;
-            break;
-
-        /* CLS (00E0)
-           Clear the display. */
-        case 0xE0:
-            chip8_reset_display(chip8, chip8->bitplane);
-            break;
-
-        /* RET (00EE):
-           Return from a subroutine. */
-        case 0xEE:
-            chip8->PC = (chip8->RAM[chip8->SP] << 8);
-            chip8->PC |= chip8->RAM[chip8->SP + 1];
-            chip8->SP -= 2;
-            break;
+            int skipped = (n - executed) / 3 * 3;
+            chip8->skipped_cycles += skipped;
+            executed += skipped;
+            if (executed >= n)
+            {
+                break;
+            }
+        }
 
-        /* SCRR (00FB) (S-CHIP Only):
-           Scroll the display right by 4 pixels. */
-        case 0xFB:
-            chip8_scroll(chip8, 1, 0, 4, chip8->bitplane);
-            break;
+        /* Draws whose VF is dead don't end their block (see
+        chip8_ends_block), so stopping right after one takes single steps. */
+        executed += chip8_execute_block(chip8, stop_on_draw ? 1 : n - executed);
 
-        /* SCRL (00FC) (S-CHIP Only):
-           Scroll the display left by 4 pixels. */
-        case 0xFC:
-            chip8_scroll(chip8, -1, 0, 4, chip8->bitplane);
+        if (stop_on_draw && chip8->display_changed)
+        {
             break;
+        }
+    }
 
-        /* EXIT (00FD) (S-CHIP Only):
-           Exit the interpreter. */
-        case 0xFD:
-            chip8->exit = true;
-            break;
+    return executed;
+}
 
-        /* LORES (00FE) (S-CHIP Only):
-           Disable HI-RES mode. */
-        case 0xFE:
-            chip8->hires = false;
+// Counts the timers down by the given number of ticks.
+static void chip8_tick_timers(CHIP8 *chip8, int64_t ticks)
+{
+    chip8->DT = (chip8->DT > ticks) ? chip8->DT - ticks : 0;
+    chip8->ST = (chip8->ST > ticks) ? chip8->ST - ticks : 0;
+}
 
-            if (!chip8->quirks[5])
-            {
-                chip8_reset_display(chip8, chip8->bitplane);
-            }
+unsigned long chip8_frame_cycles(CHIP8 *chip8)
+{
+    if (chip8->ipf)
+    {
+        return chip8->ipf;
+    }
 
-            break;
+    // Frames have no length with an uncapped refresh rate.
+    if (!chip8->refresh_freq)
+    {
+        return 0;
+    }
 
-        /* HIRES (00FF) (S-CHIP Only):
-           Enable HI-RES mode. */
-        case 0xFF:
-            chip8->hires = true;
+    unsigned long cycles = (chip8->cpu_freq + chip8->cpu_debt) /
+                           chip8->refresh_freq;
+    chip8->cpu_debt = (chip8->cpu_freq + chip8->cpu_debt) %
+                      chip8->refresh_freq;
 
-            if (!chip8->quirks[5])
-            {
-                chip8_reset_display(chip8, chip8->bitplane);
-            }
+    return cycles;
+}
 
-            break;
+int chip8_run_frame(CHIP8 *chip8, unsigned long n)
+{
+    int executed = chip8_run(chip8, (int)n, false);
 
-        default:
-            switch (y)
-            {
-            /* SCRD (00Cn) (S-CHIP Only):
-               Scroll the display down by n pixels. */
-            case 0xC:
-                chip8_scroll(chip8, 0, 1, n, chip8->bitplane);
-                break;
+    // Timers running at the refresh rate simply tick once per frame.
+    if (chip8->ipf || chip8->timer_freq == chip8->refresh_freq)
+    {
+        chip8->beep = (chip8->ST > 0);
+        chip8_tick_timers(chip8, 1);
+    }
+    else if (chip8->cpu_freq)
+    {
+        chip8->total_cycle_time = n * (ONE_SEC / chip8->cpu_freq);
+        chip8_handle_timers(chip8);
+        chip8_sync_timers(chip8);
+    }
 
-            /* SCRU (00Dn) (S-CHIP Only):
-               Scroll the display up by n pixels. */
-            case 0xD:
-                chip8_scroll(chip8, 0, -1, n, chip8->bitplane);
-                break;
-            }
+    return executed;
+}
 
-            break;
-        }
+bool chip8_calibrate(CHIP8 *chip8, double seconds, double headroom,
+                     CHIP8_CALIBRATION *calibration)
+{
+    memset(calibration, 0, sizeof(*calibration));
 
-        break;
+    // The copy gets its own instruction cache, which starts out cold.
+    CHIP8 *copy = malloc(sizeof(CHIP8));
+    if (!copy)
+    {
+        return false;
+    }
 
-    /* JP addr (1nnn)
-       Jump to location nnn. */
-    case 0x01:
-        chip8->PC = nnn;
-        break;
+    *copy = *chip8;
+    copy->icache = calloc(1, sizeof(CHIP8_ICACHE));
+    copy->calibrating = true;
+    chip8_set_ipf(copy, CALIBRATION_FRAME_CYCLES);
 
-    /* CALL addr (2nnn)
-       Call subroutine at nnn. */
-    case 0x02:
-        chip8->SP += 2;
-        chip8->RAM[chip8->SP] = chip8->PC >> 8;
-        chip8->RAM[chip8->SP + 1] = chip8->PC & 0x00FF;
-        chip8->PC = nnn;
-        break;
+    // Wall time, as other threads and processes take the host from us too.
+    int64_t limit = (int64_t)(seconds * ONE_SEC);
+    int64_t start = chip8_clock_ns();
+    int64_t elapsed = 0;
+    int key = 0;
 
-    /* SE Vx, byte (3xkk)
-       Skip next instruction if Vx = kk. */
-    case 0x03:
-        if (chip8->V[x] == kk)
+    while (copy->icache && elapsed < limit && !copy->exit && !copy->halted)
+    {
+        if (chip8_is_waiting(copy))
         {
-            chip8_skip_instr(chip8);
+            copy->keypad[key] = KEY_RELEASED;
+            key = (key + 1) % NUM_KEYS;
         }
 
-        break;
+        calibration->instructions += chip8_run_frame(copy,
+                                                     CALIBRATION_FRAME_CYCLES);
+        elapsed = chip8_clock_ns() - start;
+    }
 
-    /* SNE Vx, byte (4xkk)
-       Skip next instruction if Vx != kk. */
-    case 0x04:
-        if (chip8->V[x] != kk)
-        {
-            chip8_skip_instr(chip8);
-        }
+    free(copy->icache);
+    free(copy);
 
-        break;
+    if (!calibration->instructions || elapsed <= 0)
+    {
+        return false;
+    }
 
-    case 0x05:
-        switch (n)
-        {
-        /* SE Vx, Vy (5xy0)
-           Skip next instruction if Vx = Vy. */
-        case 0x0:
-            if (chip8->V[x] == chip8->V[y])
-            {
-                chip8_skip_instr(chip8);
-            }
+    unsigned long refresh_freq = chip8->refresh_freq ? chip8->refresh_freq
+                                                     : REFRESH_FREQ_DEFAULT;
 
-            break;
+    calibration->seconds = (double)elapsed / ONE_SEC;
+    calibration->instructions_per_sec = calibration->instructions /
+                                        calibration->seconds;
 
-        /* LD [I], Vx - Vy (5xy2) (XO-CHIP Only)
-           Store registers Vx through Vy in memory starting at location I. */
-        case 0x2:
-            if (y >= x)
-            {
-                for (int r = 0; r <= (y - x); r++)
-                {
-                    chip8->RAM[chip8->I + r] = chip8->V[x + r];
-                }
-            }
-            else
-            {
-                for (int r = 0; r <= (x - y); r++)
-                {
-                    chip8->RAM[chip8->I + r] = chip8->V[x - r];
-                }
-            }
+    calibration->ipf = (unsigned long)(calibration->instructions_per_sec *
+                                       (1 - headroom) / refresh_freq);
+    if (!calibration->ipf)
+    {
+        calibration->ipf = 1;
+    }
 
-            break;
+    calibration->cpu_freq = calibration->ipf * refresh_freq;
+    calibration->frame_time = calibration->ipf /
+                              calibration->instructions_per_sec;
 
-        /* LD Vx - Vy, [I] (5xy3) (XO-CHIP Only)
-           Read registers Vx through Vy from memory starting at location I. */
-        case 0x3:
-            if (y >= x)
-            {
-                for (int r = 0; r <= (y - x); r++)
-                {
-                    chip8->V[x + r] = chip8->RAM[chip8->I + r];
-                }
-            }
-            else
-            {
-                for (int r = 0; r <= (x - y); r++)
-                {
-                    chip8->V[x - r] = chip8->RAM[chip8->I + r];
-                }
-            }
+    return true;
+}
 
-            break;
-        }
+/* HALT (0000)
+   Halt the emulator. */
+static void op_0000(CHIP8 *chip8, const CHIP8_INSTR *instr)
+{
+    (void)instr;
+    chip8->PC -= 2;
+    chip8->halted = true;
+}
 
-        break;
+/* SCRD (00Cn) (S-CHIP Only):
+   Scroll the display down by n pixels. */
+static void op_00Cn(CHIP8 *chip8, const CHIP8_INSTR *instr)
+{
+    chip8_scroll(chip8, 0, 1, instr->n, chip8->bitplane);
+}
 
-    /* LD Vx, byte (6xkk)
-       Set Vx = kk. */
-    case 0x06:
-        chip8->V[x] = kk;
-        break;
+/* SCRU (00Dn) (S-CHIP Only):
+   Scroll the display up by n pixels. */
+static void op_00Dn(CHIP8 *chip8, const CHIP8_INSTR *instr)
+{
+    chip8_scroll(chip8, 0, -1, instr->n, chip8->bitplane);
+}
 
-    /* ADD Vx, byte (7xkk)
-       Set Vx = Vx + kk. */
-    case 0x07:
-        chip8->V[x] += kk;
-        break;
+/* CLS (00E0)
+   Clear the display. */
+static void op_00E0(CHIP8 *chip8, const CHIP8_INSTR *instr)
+{
+    (void)instr;
+    chip8_reset_display(chip8, chip8->bitplane);
+}
 
-    case 0x08:
-        switch (n)
-        {
-        /* LD Vx, Vy (8xy0)
-           Set Vx = Vy. */
-        case 0x00:
-            chip8->V[x] = chip8->V[y];
-            break;
+/* RET (00EE):
+   Return from a subroutine. */
+static void op_00EE(CHIP8 *chip8, const CHIP8_INSTR *instr)
+{
+    (void)instr;
+    chip8->PC = (chip8->RAM[chip8->SP] << 8);
+    chip8->PC |= chip8->RAM[chip8->SP + 1];
+    chip8->SP -= 2;
+}
 
-        /* OR Vx, Vy (8xy1)
-           Set Vx = Vx OR Vy.
-           Legacy: Set VF = 0.
-           S-CHIP: Leave VF alone. */
-        case 0x01:
-            chip8->V[x] |= chip8->V[y];
+/* SCRR (00FB) (S-CHIP Only):
+   Scroll the display right by 4 pixels. */
+static void op_00FB(CHIP8 *chip8, const CHIP8_INSTR *instr)
+{
+    (void)instr;
+    chip8_scroll(chip8, 1, 0, 4, chip8->bitplane);
+}
 
-            if (!chip8->quirks[9])
-            {
-                chip8->V[0x0F] = 0;
-            }
-            break;
+/* SCRL (00FC) (S-CHIP Only):
+   Scroll the display left by 4 pixels. */
+static void op_00FC(CHIP8 *chip8, const CHIP8_INSTR *instr)
+{
+    (void)instr;
+    chip8_scroll(chip8, -1, 0, 4, chip8->bitplane);
+}
 
-        /* AND Vx, Vy (8xy2)
-           Set Vx = Vx AND Vy.
-           Legacy: Set VF = 0.
-           S-CHIP: Leave VF alone. */
-        case 0x02:
-            chip8->V[x] &= chip8->V[y];
-            
-            if (!chip8->quirks[9])
-            {
-                chip8->V[0x0F] = 0;
-            }
-            break;
+/* EXIT (00FD) (S-CHIP Only):
+   Exit the interpreter. */
+static void op_00FD(CHIP8 *chip8, const CHIP8_INSTR *instr)
+{
+    (void)instr;
+    chip8->exit = true;
+}
 
-        /* XOR Vx, Vy (8xy3)
-           Set Vx = Vx XOR Vy.
-           Legacy: Set VF = 0.
-           S-CHIP: Leave VF alone. */
-        case 0x03:
-            chip8->V[x] ^= chip8->V[y];
-            
-            if (!chip8->quirks[9])
-            {
-                chip8->V[0x0F] = 0;
-            }
-            break;
+/* LORES (00FE) (S-CHIP Only):
+   Disable HI-RES mode.
+   Legacy: Also clear the display. */
+static void op_00FE(CHIP8 *chip8, const CHIP8_INSTR *instr)
+{
+    (void)instr;
+    chip8->hires = false;
+    chip8_pack_lores(chip8);
+    chip8_invalidate_display(chip8);
+}
 
-        /* ADD Vx, Vy (8xy4)
-           Set Vx = Vx + Vy, set VF = carry. */
-        case 0x04:
-        {
-            bool carry = ((chip8->V[x] + chip8->V[y]) > 0xFF);
-            chip8->V[x] += chip8->V[y];
-            chip8->V[0x0F] = carry;
-            break;
-        }
+static void op_00FE_legacy(CHIP8 *chip8, const CHIP8_INSTR *instr)
+{
+    (void)instr;
+    chip8->hires = false;
+    chip8_invalidate_display(chip8);
+    chip8_reset_display(chip8, chip8->bitplane);
+}
 
-        /* SUB Vx, Vy (8xy5)
-           Set Vx = Vx - Vy, set VF = NOT borrow. */
-        case 0x05:
-        {
-            bool no_borrow = (chip8->V[x] >= chip8->V[y]);
-            chip8->V[x] = chip8->V[x] - chip8->V[y];
-            chip8->V[0x0F] = no_borrow;
-            break;
-        }
+/* HIRES (00FF) (S-CHIP Only):
+   Enable HI-RES mode.
+   Legacy: Also clear the display. */
+static void op_00FF(CHIP8 *chip8, const CHIP8_INSTR *instr)
+{
+    (void)instr;
+    chip8->hires = true;
+    chip8_expand_lores(chip8);
+    chip8_invalidate_display(chip8);
+}
 
-        /* SHR Vx {, Vy} (8xy6)
-           Legacy: Set Vx = Vy SHR 1.
-           S-CHIP: Set Vx = Vx SHR 1. */
-        case 0x06:
-        {
-            if (!chip8->quirks[1])
-            {
-                chip8->V[x] = chip8->V[y];
-            }
+static void op_00FF_legacy(CHIP8 *chip8, const CHIP8_INSTR *instr)
+{
+    (void)instr;
+    chip8->hires = true;
+    chip8_expand_lores(chip8);
+    chip8_invalidate_display(chip8);
+    chip8_reset_display(chip8, chip8->bitplane);
+}
 
-            int carry = chip8->V[x] & 0x01;
-            chip8->V[x] >>= 1;
-            chip8->V[0x0F] = carry;
-            break;
-        }
+/* JP addr (1nnn)
+   Jump to location nnn. */
+static void op_1nnn(CHIP8 *chip8, const CHIP8_INSTR *instr)
+{
+    // Jumping to itself leaves the program stuck there for good.
+    if (instr->nnn == (uint16_t)(chip8->PC - 2))
+    {
+        chip8->halted = true;
+    }
 
-        /* SUBN Vx, Vy (8xy7)
-           Set Vx = Vy - Vx, set VF = NOT borrow. */
-        case 0x07:
-        {
-            bool no_borrow = (chip8->V[y] >= chip8->V[x]);
-            chip8->V[x] = chip8->V[y] - chip8->V[x];
-            chip8->V[0x0F] = no_borrow;
-            break;
-        }
+    chip8->PC = instr->nnn;
+}
 
-        /* SHL Vx {, Vy} (8xyE)
-           Legacy: Set Vx = Vy SHL 1.
-           S-CHIP: Set Vx = Vx SHL 1. */
-        case 0x0E:
-        {
-            if (!chip8->quirks[1])
-            {
-                chip8->V[x] = chip8->V[y];
-            }
+/* CALL addr (2nnn)
+   Call subroutine at nnn. */
+static void op_2nnn(CHIP8 *chip8, const CHIP8_INSTR *instr)
+{
+    chip8->SP += 2;
+    chip8->RAM[chip8->SP] = chip8->PC >> 8;
+    chip8->RAM[chip8->SP + 1] = chip8->PC & 0x00FF;
+    chip8_invalidate_code(chip8, chip8->SP, 2);
+    chip8->PC = instr->nnn;
+}
 
-            //chip8->V[0x0F] = (chip8->V[x] & 0x80) >> 7;
-            int carry = (chip8->V[x] & 0x80) >> 7;
-            chip8->V[x] <<= 1;
-            chip8->V[0x0F] = carry;
-            break;
+/* SE Vx, byte (3xkk)
+   Skip next instruction if Vx = kk. */
+static void op_3xkk(CHIP8 *chip8, const CHIP8_INSTR *instr)
+{
+    if (chip8->V[instr->x] == instr->kk)
+    {
+        chip8_skip_instr(chip8);
+    }
+}
+
+/* SNE Vx, byte (4xkk)
+   Skip next instruction if Vx != kk. */
+static void op_4xkk(CHIP8 *chip8, const CHIP8_INSTR *instr)
+{
+    if (chip8->V[instr->x] != instr->kk)
+    {
+        chip8_skip_instr(chip8);
+    }
+}
+
+/* SE Vx, Vy (5xy0)
+   Skip next instruction if Vx = Vy. */
+static void op_5xy0(CHIP8 *chip8, const CHIP8_INSTR *instr)
+{
+    if (chip8->V[instr->x] == chip8->V[instr->y])
+    {
+        chip8_skip_instr(chip8);
+    }
+}
+
+/* LD [I], Vx - Vy (5xy2) (XO-CHIP Only)
+   Store registers Vx through Vy in memory starting at location I. */
+static void op_5xy2(CHIP8 *chip8, const CHIP8_INSTR *instr)
+{
+    uint8_t x = instr->x, y = instr->y;
+
+    if (y >= x)
+    {
+        for (int r = 0; r <= (y - x); r++)
+        {
+            chip8->RAM[chip8->I + r] = chip8->V[x + r];
+        }
+
+        chip8_invalidate_code(chip8, chip8->I, (y - x) + 1);
+    }
+    else
+    {
+        for (int r = 0; r <= (x - y); r++)
+        {
+            chip8->RAM[chip8->I + r] = chip8->V[x - r];
+        }
+
+        chip8_invalidate_code(chip8, chip8->I, (x - y) + 1);
+    }
+}
+
+/* LD Vx - Vy, [I] (5xy3) (XO-CHIP Only)
+   Read registers Vx through Vy from memory starting at location I. */
+static void op_5xy3(CHIP8 *chip8, const CHIP8_INSTR *instr)
+{
+    uint8_t x = instr->x, y = instr->y;
+
+    if (y >= x)
+    {
+        for (int r = 0; r <= (y - x); r++)
+        {
+            chip8->V[x + r] = chip8->RAM[chip8->I + r];
+        }
+    }
+    else
+    {
+        for (int r = 0; r <= (x - y); r++)
+        {
+            chip8->V[x - r] = chip8->RAM[chip8->I + r];
+        }
+    }
+}
+
+/* LD Vx, byte (6xkk)
+   Set Vx = kk. */
+static void op_6xkk(CHIP8 *chip8, const CHIP8_INSTR *instr)
+{
+    chip8->V[instr->x] = instr->kk;
+}
+
+/* ADD Vx, byte (7xkk)
+   Set Vx = Vx + kk. */
+static void op_7xkk(CHIP8 *chip8, const CHIP8_INSTR *instr)
+{
+    chip8->V[instr->x] += instr->kk;
+}
+
+/* LD Vx, Vy (8xy0)
+   Set Vx = Vy. */
+static void op_8xy0(CHIP8 *chip8, const CHIP8_INSTR *instr)
+{
+    chip8->V[instr->x] = chip8->V[instr->y];
+}
+
+/* OR Vx, Vy (8xy1)
+   Set Vx = Vx OR Vy.
+   Legacy: Set VF = 0.
+   S-CHIP: Leave VF alone. */
+static void op_8xy1(CHIP8 *chip8, const CHIP8_INSTR *instr)
+{
+    chip8->V[instr->x] |= chip8->V[instr->y];
+}
+
+static void op_8xy1_legacy(CHIP8 *chip8, const CHIP8_INSTR *instr)
+{
+    chip8->V[instr->x] |= chip8->V[instr->y];
+    chip8->V[0x0F] = 0;
+}
+
+/* AND Vx, Vy (8xy2)
+   Set Vx = Vx AND Vy.
+   Legacy: Set VF = 0.
+   S-CHIP: Leave VF alone. */
+static void op_8xy2(CHIP8 *chip8, const CHIP8_INSTR *instr)
+{
+    chip8->V[instr->x] &= chip8->V[instr->y];
+}
+
+static void op_8xy2_legacy(CHIP8 *chip8, const CHIP8_INSTR *instr)
+{
+    chip8->V[instr->x] &= chip8->V[instr->y];
+    chip8->V[0x0F] = 0;
+}
+
+/* XOR Vx, Vy (8xy3)
+   Set Vx = Vx XOR Vy.
+   Legacy: Set VF = 0.
+   S-CHIP: Leave VF alone. */
+static void op_8xy3(CHIP8 *chip8, const CHIP8_INSTR *instr)
+{
+    chip8->V[instr->x] ^= chip8->V[instr->y];
+}
+
+static void op_8xy3_legacy(CHIP8 *chip8, const CHIP8_INSTR *instr)
+{
+    chip8->V[instr->x] ^= chip8->V[instr->y];
+    chip8->V[0x0F] = 0;
+}
+
+/* ADD Vx, Vy (8xy4)
+   Set Vx = Vx + Vy, set VF = carry. */
+static void op_8xy4(CHIP8 *chip8, const CHIP8_INSTR *instr)
+{
+    bool carry = ((chip8->V[instr->x] + chip8->V[instr->y]) > 0xFF);
+    chip8->V[instr->x] += chip8->V[instr->y];
+    chip8->V[0x0F] = carry;
+}
+
+// The same without setting VF, for when it is dead (see chip8_vf_is_dead).
+static void op_8xy4_no_vf(CHIP8 *chip8, const CHIP8_INSTR *instr)
+{
+    chip8->V[instr->x] += chip8->V[instr->y];
+}
+
+/* SUB Vx, Vy (8xy5)
+   Set Vx = Vx - Vy, set VF = NOT borrow. */
+static void op_8xy5(CHIP8 *chip8, const CHIP8_INSTR *instr)
+{
+    bool no_borrow = (chip8->V[instr->x] >= chip8->V[instr->y]);
+    chip8->V[instr->x] = chip8->V[instr->x] - chip8->V[instr->y];
+    chip8->V[0x0F] = no_borrow;
+}
+
+static void op_8xy5_no_vf(CHIP8 *chip8, const CHIP8_INSTR *instr)
+{
+    chip8->V[instr->x] -= chip8->V[instr->y];
+}
+
+/* SHR Vx {, Vy} (8xy6)
+   Legacy: Set Vx = Vy SHR 1.
+   S-CHIP: Set Vx = Vx SHR 1. */
+static void op_8xy6(CHIP8 *chip8, const CHIP8_INSTR *instr)
+{
+    int carry = chip8->V[instr->x] & 0x01;
+    chip8->V[instr->x] >>= 1;
+    chip8->V[0x0F] = carry;
+}
+
+static void op_8xy6_legacy(CHIP8 *chip8, const CHIP8_INSTR *instr)
+{
+    int carry = chip8->V[instr->y] & 0x01;
+    chip8->V[instr->x] = chip8->V[instr->y] >> 1;
+    chip8->V[0x0F] = carry;
+}
+
+static void op_8xy6_no_vf(CHIP8 *chip8, const CHIP8_INSTR *instr)
+{
+    chip8->V[instr->x] >>= 1;
+}
+
+static void op_8xy6_legacy_no_vf(CHIP8 *chip8, const CHIP8_INSTR *instr)
+{
+    chip8->V[instr->x] = chip8->V[instr->y] >> 1;
+}
+
+/* SUBN Vx, Vy (8xy7)
+   Set Vx = Vy - Vx, set VF = NOT borrow. */
+static void op_8xy7(CHIP8 *chip8, const CHIP8_INSTR *instr)
+{
+    bool no_borrow = (chip8->V[instr->y] >= chip8->V[instr->x]);
+    chip8->V[instr->x] = chip8->V[instr->y] - chip8->V[instr->x];
+    chip8->V[0x0F] = no_borrow;
+}
+
+static void op_8xy7_no_vf(CHIP8 *chip8, const CHIP8_INSTR *instr)
+{
+    chip8->V[instr->x] = chip8->V[instr->y] - chip8->V[instr->x];
+}
+
+/* SHL Vx {, Vy} (8xyE)
+   Legacy: Set Vx = Vy SHL 1.
+   S-CHIP: Set Vx = Vx SHL 1. */
+static void op_8xyE(CHIP8 *chip8, const CHIP8_INSTR *instr)
+{
+    int carry = (chip8->V[instr->x] & 0x80) >> 7;
+    chip8->V[instr->x] <<= 1;
+    chip8->V[0x0F] = carry;
+}
+
+static void op_8xyE_legacy(CHIP8 *chip8, const CHIP8_INSTR *instr)
+{
+    int carry = (chip8->V[instr->y] & 0x80) >> 7;
+    chip8->V[instr->x] = chip8->V[instr->y] << 1;
+    chip8->V[0x0F] = carry;
+}
+
+static void op_8xyE_no_vf(CHIP8 *chip8, const CHIP8_INSTR *instr)
+{
+    chip8->V[instr->x] <<= 1;
+}
+
+static void op_8xyE_legacy_no_vf(CHIP8 *chip8, const CHIP8_INSTR *instr)
+{
+    chip8->V[instr->x] = chip8->V[instr->y] << 1;
+}
+
+/* SNE Vx, Vy (9xy0)
+   Skip next instruction if Vx != Vy. */
+static void op_9xy0(CHIP8 *chip8, const CHIP8_INSTR *instr)
+{
+    if (chip8->V[instr->x] != chip8->V[instr->y])
+    {
+        chip8_skip_instr(chip8);
+    }
+}
+
+/* LD I, addr (Annn)
+   Set I = nnn. */
+static void op_Annn(CHIP8 *chip8, const CHIP8_INSTR *instr)
+{
+    chip8->I = instr->nnn;
+}
+
+/* JP V0, addr (Bnnn)
+   Legacy: Jump to location nnn + V0.
+   S-CHIP: Jump to location nnn + Vx. */
+static void op_Bnnn(CHIP8 *chip8, const CHIP8_INSTR *instr)
+{
+    chip8->PC = chip8->V[instr->x] + instr->nnn;
+}
+
+static void op_Bnnn_legacy(CHIP8 *chip8, const CHIP8_INSTR *instr)
+{
+    chip8->PC = chip8->V[0] + instr->nnn;
+}
+
+/* RND Vx, byte (Cxkk)
+   Set Vx = random byte AND kk. */
+static void op_Cxkk(CHIP8 *chip8, const CHIP8_INSTR *instr)
+{
+    chip8->V[instr->x] = chip8_rand(chip8) & instr->kk;
+}
+
+/* DRW Vx, Vy, n (Dxyn):
+   Legacy: Display n-byte sprite starting at memory location I at (Vx, Vy),
+   set VF = collision.
+   S-CHIP: If hires=false: If n=0, display 8x16 sprite. Else:
+   Same as Legacy. If hires=true: Same as Legacy, except
+   set VF = num rows collision. If n=0: Display 16x16 sprite starting at
+   memory location I at (Vx, Vy), set VF = num rows collision. */
+static void op_Dxyn(CHIP8 *chip8, const CHIP8_INSTR *instr)
+{
+    chip8_draw(chip8, chip8->V[instr->x], chip8->V[instr->y], instr->n,
+               chip8->bitplane);
+}
+
+/* Draws whose VF gets overwritten before being read (see chip8_vf_is_dead)
+skip collision detection. */
+static void op_Dxyn_no_vf(CHIP8 *chip8, const CHIP8_INSTR *instr)
+{
+    chip8_draw_no_vf(chip8, chip8->V[instr->x], chip8->V[instr->y], instr->n,
+                     chip8->bitplane);
+}
+
+#define CHIP8_DRAW_OP(name, q4, q6, q7, q8)                                 \
+    static void op_Dxyn_##name(CHIP8 *chip8, const CHIP8_INSTR *instr)      \
+    {                                                                       \
+        chip8_draw_##name(chip8, chip8->V[instr->x], chip8->V[instr->y],    \
+                          instr->n, chip8->bitplane);                       \
+    }                                                                       \
+                                                                            \
+    static void op_Dxyn_##name##_no_vf(CHIP8 *chip8,                        \
+                                       const CHIP8_INSTR *instr)            \
+    {                                                                       \
+        chip8_draw_##name##_no_vf(chip8, chip8->V[instr->x],                \
+                                  chip8->V[instr->y], instr->n,             \
+                                  chip8->bitplane);                         \
+    }
+
+CHIP8_DRAW_PROFILES(CHIP8_DRAW_OP)
+
+/* SKP Vx (Ex9E)
+   Skip next instruction if key with the value of Vx is pressed. */
+static void op_Ex9E(CHIP8 *chip8, const CHIP8_INSTR *instr)
+{
+    if (chip8->keypad[chip8->V[instr->x]] == KEY_DOWN)
+    {
+        chip8_skip_instr(chip8);
+    }
+}
+
+/* SKNP Vx (ExA1)
+   Skip next instruction if key with the value of Vx is not pressed. */
+static void op_ExA1(CHIP8 *chip8, const CHIP8_INSTR *instr)
+{
+    if (chip8->keypad[chip8->V[instr->x]] == KEY_UP)
+    {
+        chip8_skip_instr(chip8);
+    }
+}
+
+/* LD I, nnnn (XO-CHIP Only)
+   Set I = 16-bit address (stored in next two bytes). */
+static void op_F000(CHIP8 *chip8, const CHIP8_INSTR *instr)
+{
+    (void)instr;
+    chip8->I = (chip8->RAM[chip8->PC]) << 8;
+    chip8->I |= (chip8->RAM[chip8->PC + 1]);
+    chip8->PC += 2;
+}
+
+/* PLANE n (XO-CHIP Only)
+   Set the bitplane where 0 <= n <= 3. */
+static void op_Fx01(CHIP8 *chip8, const CHIP8_INSTR *instr)
+{
+    uint8_t x = instr->x;
+
+    if (x > NUM_BITPLANES)
+    {
+        x = NUM_BITPLANES;
+    }
+
+    chip8->bitplane = (CHIP8BP) x;
+}
+
+/* AUDIO (XO-CHIP Only)
+   Store bytes starting at I in the audio pattern buffer. */
+static void op_F002(CHIP8 *chip8, const CHIP8_INSTR *instr)
+{
+    (void)instr;
+
+    for (int i = 0; i < AUDIO_BUF_SIZE; i++)
+    {
+        chip8->RAM[AUDIO_BUF_ADDR + i] = chip8->RAM[chip8->I + i];
+    }
+
+    chip8_invalidate_code(chip8, AUDIO_BUF_ADDR, AUDIO_BUF_SIZE);
+}
+
+/* LD Vx, DT (Fx07)
+   Set Vx = delay timer value. */
+static void op_Fx07(CHIP8 *chip8, const CHIP8_INSTR *instr)
+{
+    chip8_sync_timers(chip8);
+    chip8->V[instr->x] = chip8->DT;
+}
+
+/* LD Vx, K (Fx0A)
+   Wait for a key press, store the value of the key in Vx. */
+static void op_Fx0A(CHIP8 *chip8, const CHIP8_INSTR *instr)
+{
+    chip8_wait_key(chip8, instr->x);
+}
+
+/* LD DT, Vx (Fx15)
+   Set delay timer = Vx. */
+static void op_Fx15(CHIP8 *chip8, const CHIP8_INSTR *instr)
+{
+    // Ticks still owed to the old value must not be taken from the new one.
+    chip8_sync_timers(chip8);
+    chip8->DT = chip8->V[instr->x];
+}
+
+/* LD ST, Vx (Fx18)
+   Set sound timer = Vx. */
+static void op_Fx18(CHIP8 *chip8, const CHIP8_INSTR *instr)
+{
+    chip8_sync_timers(chip8);
+    chip8->ST = chip8->V[instr->x];
+}
+
+/* ADD I, Vx (Fx1E):
+   Set I = I + Vx. */
+static void op_Fx1E(CHIP8 *chip8, const CHIP8_INSTR *instr)
+{
+    chip8->I += chip8->V[instr->x];
+}
+
+/* LD F, Vx (Fx29)
+   Set I = location of 5-byte sprite for digit Vx. */
+static void op_Fx29(CHIP8 *chip8, const CHIP8_INSTR *instr)
+{
+    chip8->I = FONT_START_ADDR + (chip8->V[instr->x] * 0x05);
+}
+
+/* LD HF, Vx (Fx30) (S-CHIP Only)
+   Set I = location of 10-byte sprite for digit Vx. */
+static void op_Fx30(CHIP8 *chip8, const CHIP8_INSTR *instr)
+{
+    chip8->I = BIG_FONT_START_ADDR + (chip8->V[instr->x] * 0x0A);
+}
+
+/* LD B, Vx (Fx33)
+   Store BCD representation of Vx in memory locations:
+   I, I+1, and I+2. */
+static void op_Fx33(CHIP8 *chip8, const CHIP8_INSTR *instr)
+{
+    chip8->RAM[chip8->I] = (chip8->V[instr->x] / 100) % 10;
+    chip8->RAM[chip8->I + 1] = (chip8->V[instr->x] / 10) % 10;
+    chip8->RAM[chip8->I + 2] = chip8->V[instr->x] % 10;
+    chip8_invalidate_code(chip8, chip8->I, 3);
+}
+
+/* PITCH Vx (Fx3A) (XO-CHIP Only)
+   Set audio pitch to Vx. */
+static void op_Fx3A(CHIP8 *chip8, const CHIP8_INSTR *instr)
+{
+    chip8->pitch = chip8->V[instr->x];
+}
+
+/* LD [I], Vx (Fx55)
+   Store registers V0 through Vx in memory starting at location I.
+   Legacy: Set I=I+x+1 */
+static void op_Fx55(CHIP8 *chip8, const CHIP8_INSTR *instr)
+{
+    for (int r = 0; r <= instr->x; r++)
+    {
+        chip8->RAM[chip8->I + r] = chip8->V[r];
+    }
+
+    chip8_invalidate_code(chip8, chip8->I, instr->x + 1);
+}
+
+static void op_Fx55_legacy(CHIP8 *chip8, const CHIP8_INSTR *instr)
+{
+    op_Fx55(chip8, instr);
+    chip8->I += (instr->x + 1);
+}
+
+/* LD Vx, [I] (Fx65)
+   Read registers V0 through Vx from memory starting at location I.
+   Legacy: Set I=I+x+1 */
+static void op_Fx65(CHIP8 *chip8, const CHIP8_INSTR *instr)
+{
+    for (int r = 0; r <= instr->x; r++)
+    {
+        chip8->V[r] = chip8->RAM[chip8->I + r];
+    }
+}
+
+static void op_Fx65_legacy(CHIP8 *chip8, const CHIP8_INSTR *instr)
+{
+    op_Fx65(chip8, instr);
+    chip8->I += (instr->x + 1);
+}
+
+/* LD uflags_disk, V0..Vx (Fx75) (S-CHIP Only)
+   Save user flags to disk. */
+static void op_Fx75(CHIP8 *chip8, const CHIP8_INSTR *instr)
+{
+    if (chip8->calibrating)
+    {
+        return;
+    }
+
+    if (!chip8_handle_user_flags(chip8, instr->x + 1, true))
+    {
+        fprintf(stderr, "Unable to save user flags to %s\n", chip8->UF_path);
+    }
+}
+
+/* LD V0..Vx, uflags_disk (Fx85) (S-CHIP Only)
+   Load user flags from disk. */
+static void op_Fx85(CHIP8 *chip8, const CHIP8_INSTR *instr)
+{
+    if (!chip8_handle_user_flags(chip8, instr->x + 1, false))
+    {
+        fprintf(stderr, "Unable to load user flags from %s\n", chip8->UF_path);
+    }
+}
+
+// Undefined instructions do nothing.
+static void op_nop(CHIP8 *chip8, const CHIP8_INSTR *instr)
+{
+    (void)chip8;
+    (void)instr;
+}
+
+// Every instruction handler, used to build the dispatch tables.
+#define CHIP8_OPS(X) \
+    X(0000) X(00Cn) X(00Dn) X(00E0) X(00EE) X(00FB) \
+    X(00FC) X(00FD) X(00FE) X(00FE_legacy) X(00FF) X(00FF_legacy) \
+    X(1nnn) X(2nnn) X(3xkk) X(4xkk) X(5xy0) X(5xy2) \
+    X(5xy3) X(6xkk) X(7xkk) X(8xy0) X(8xy1) X(8xy1_legacy) \
+    X(8xy2) X(8xy2_legacy) X(8xy3) X(8xy3_legacy) X(8xy4) X(8xy4_no_vf) \
+    X(8xy5) X(8xy5_no_vf) X(8xy6) X(8xy6_no_vf) X(8xy6_legacy) \
+    X(8xy6_legacy_no_vf) X(8xy7) X(8xy7_no_vf) X(8xyE) X(8xyE_no_vf) \
+    X(8xyE_legacy) X(8xyE_legacy_no_vf) X(9xy0) \
+    X(Annn) X(Bnnn) X(Bnnn_legacy) X(Cxkk) X(Dxyn) X(Dxyn_schip) \
+    X(Dxyn_legacy) X(Dxyn_xochip) X(Dxyn_no_vf) X(Dxyn_schip_no_vf) \
+    X(Dxyn_legacy_no_vf) X(Dxyn_xochip_no_vf) X(Ex9E) X(ExA1) X(F000) X(Fx01) \
+    X(F002) X(Fx07) X(Fx0A) X(Fx15) X(Fx18) X(Fx1E) \
+    X(Fx29) X(Fx30) X(Fx33) X(Fx3A) X(Fx55) X(Fx55_legacy) \
+    X(Fx65) X(Fx65_legacy) X(Fx75) X(Fx85) X(nop)
+
+#define CHIP8_OP_ID(name) OP_##name,
+#define CHIP8_OP_HANDLER(name) op_##name,
+
+// Identifiers of the instruction handlers (see CHIP8_INSTR.op).
+enum
+{
+    CHIP8_OPS(CHIP8_OP_ID)
+    NUM_OPS
+};
+
+static void (*const chip8_handlers[NUM_OPS])(CHIP8 *chip8,
+                                             const CHIP8_INSTR *instr) = {
+    CHIP8_OPS(CHIP8_OP_HANDLER)
+};
+
+// How an instruction uses VF.
+typedef enum
+{
+    VF_READ,
+    VF_WRITTEN,
+    VF_UNTOUCHED
+} CHIP8_VF_USE;
+
+/* Tells whether the instruction at addr reads VF (or might, or ends a basic
+block, or writes RAM), overwrites it without reading it, or does not touch it. */
+static CHIP8_VF_USE chip8_vf_use(CHIP8 *chip8, uint16_t addr)
+{
+    uint8_t b1 = chip8->RAM[addr], b2 = chip8->RAM[(uint16_t)(addr + 1)];
+    uint8_t x = b1 & 0xF, y = b2 >> 4;
+
+    switch (b1 >> 4)
+    {
+    case 0x06:
+    case 0x0C:
+        return (x == 0xF) ? VF_WRITTEN : VF_UNTOUCHED;
+
+    case 0x07:
+        return (x == 0xF) ? VF_READ : VF_UNTOUCHED;
+
+    case 0x08:
+        if ((b2 & 0xF) == 0x0 && x == 0xF && y != 0xF)
+        {
+            return VF_WRITTEN;
         }
+
+        if (x == 0xF || y == 0xF)
+        {
+            return VF_READ;
         }
 
-        break;
+        switch (b2 & 0xF)
+        {
+        case 0x0: return VF_UNTOUCHED;
+        case 0x1:
+        case 0x2:
+        case 0x3: return chip8->quirks[9] ? VF_UNTOUCHED : VF_WRITTEN;
+        case 0x4:
+        case 0x5:
+        case 0x6:
+        case 0x7:
+        case 0xE: return VF_WRITTEN;
+        default: return VF_READ;
+        }
+
+    case 0x0A:
+        return VF_UNTOUCHED;
+
+    case 0x0F:
+        switch (b2)
+        {
+        case 0x01: return VF_UNTOUCHED;
+        case 0x07:
+        case 0x65: return (x == 0xF) ? VF_WRITTEN : VF_UNTOUCHED;
+        case 0x15:
+        case 0x18:
+        case 0x1E:
+        case 0x29:
+        case 0x30:
+        case 0x3A: return (x == 0xF) ? VF_READ : VF_UNTOUCHED;
+        default: return VF_READ;
+        }
+
+    default:
+        return VF_READ;
+    }
+}
+
+/* Returns true if VF is overwritten before being read after the instruction at
+addr, in the same basic block. A block runs in one go unless it is cut short
+(see chip8_exact_op), so VF is exact wherever execution stops. */
+static bool chip8_vf_is_dead(CHIP8 *chip8, uint16_t addr)
+{
+    int page_end = ((addr / CODE_PAGE_SIZE) + 1) * CODE_PAGE_SIZE;
+
+    for (int next = addr + 2; next + 1 < page_end; next += 2)
+    {
+        switch (chip8_vf_use(chip8, next))
+        {
+        case VF_READ:
+            return false;
+        case VF_WRITTEN:
+            return true;
+        case VF_UNTOUCHED:
+            break;
+        }
+    }
+
+    return false;
+}
+
+/* Picks the draw handler specialized for the current quirks, if there is one,
+skipping collisions if VF is dead after the draw. */
+static uint8_t chip8_draw_op(CHIP8 *chip8, bool vf_dead)
+{
+#define CHIP8_DRAW_MATCH(name, q4, q6, q7, q8)                              \
+    if (chip8->quirks[4] == q4 && chip8->quirks[6] == q6 &&                 \
+        chip8->quirks[7] == q7 && chip8->quirks[8] == q8)                   \
+    {                                                                       \
+        return vf_dead ? OP_Dxyn_##name##_no_vf : OP_Dxyn_##name;           \
+    }
+
+    CHIP8_DRAW_PROFILES(CHIP8_DRAW_MATCH)
+#undef CHIP8_DRAW_MATCH
+
+    return vf_dead ? OP_Dxyn_no_vf : OP_Dxyn;
+}
+
+/* Returns the op that computes VF in place of one that skips it because VF is
+dead. Used to run instructions outside of a whole basic block, where the
+instruction overwriting VF may not be reached. */
+static uint8_t chip8_exact_op(CHIP8 *chip8, uint8_t op)
+{
+#define CHIP8_DRAW_EXACT(name, q4, q6, q7, q8) \
+    case OP_Dxyn_##name##_no_vf: return OP_Dxyn_##name;
+
+    switch (op)
+    {
+    case OP_8xy1: return chip8->quirks[9] ? OP_8xy1 : OP_8xy1_legacy;
+    case OP_8xy2: return chip8->quirks[9] ? OP_8xy2 : OP_8xy2_legacy;
+    case OP_8xy3: return chip8->quirks[9] ? OP_8xy3 : OP_8xy3_legacy;
+    case OP_8xy4_no_vf: return OP_8xy4;
+    case OP_8xy5_no_vf: return OP_8xy5;
+    case OP_8xy6_no_vf: return OP_8xy6;
+    case OP_8xy6_legacy_no_vf: return OP_8xy6_legacy;
+    case OP_8xy7_no_vf: return OP_8xy7;
+    case OP_8xyE_no_vf: return OP_8xyE;
+    case OP_8xyE_legacy_no_vf: return OP_8xyE_legacy;
+    case OP_Dxyn_no_vf: return OP_Dxyn;
+    CHIP8_DRAW_PROFILES(CHIP8_DRAW_EXACT)
+    default: return op;
+    }
+#undef CHIP8_DRAW_EXACT
+}
+
+// Fetches and decodes the instruction at addr.
+static void chip8_decode(CHIP8 *chip8, uint16_t addr, CHIP8_INSTR *instr)
+{
+    /* Fetch */
+    // The first and second byte of instruction respectively.
+    uint8_t b1 = chip8->RAM[addr],
+            b2 = chip8->RAM[(uint16_t)(addr + 1)];
+
+    /* Decode */
+    // The code (first 4 bits) of instruction.
+    uint8_t c = b1 >> 4;
+
+    // The last 12 bits of instruction.
+    instr->nnn = ((b1 & 0xF) << 8) | b2;
+
+    // The last 4 bits of instruction.
+    instr->n = b2 & 0xF;
+
+    // The last 4 bits of first byte of instruction.
+    instr->x = b1 & 0xF;
+
+    // The first 4 bits of second byte of instruction.
+    instr->y = b2 >> 4;
+
+    // The last 8 bits of instruction.
+    instr->kk = b2;
+
+    instr->op = OP_nop;
 
-    /* SNE Vx, Vy (9xy0)
-       Skip next instruction if Vx != Vy. */
-    case 0x09:
-        if (chip8->V[x] != chip8->V[y])
+    switch (c)
+    {
+    case 0x00:
+        switch (b2)
         {
-            chip8_skip_instr(chip8);
+        case 0x00: instr->op = OP_0000; break;
+        case 0xE0: instr->op = OP_00E0; break;
+        case 0xEE: instr->op = OP_00EE; break;
+        case 0xFB: instr->op = OP_00FB; break;
+        case 0xFC: instr->op = OP_00FC; break;
+        case 0xFD: instr->op = OP_00FD; break;
+        case 0xFE: instr->op = chip8->quirks[5] ? OP_00FE : OP_00FE_legacy; break;
+        case 0xFF: instr->op = chip8->quirks[5] ? OP_00FF : OP_00FF_legacy; break;
+        default:
+            switch (instr->y)
+            {
+            case 0xC: instr->op = OP_00Cn; break;
+            case 0xD: instr->op = OP_00Dn; break;
+            }
+
+            break;
         }
 
         break;
 
-    /* LD I, addr (Annn)
-       Set I = nnn. */
-    case 0x0A:
-        chip8->I = nnn;
-        break;
+    case 0x01: instr->op = OP_1nnn; break;
+    case 0x02: instr->op = OP_2nnn; break;
+    case 0x03: instr->op = OP_3xkk; break;
+    case 0x04: instr->op = OP_4xkk; break;
 
-    /* JP V0, addr (Bnnn)
-       Legacy: Jump to location nnn + V0.
-       S-CHIP: Jump to location nnn + Vx. */
-    case 0x0B:
-        chip8->PC = (!chip8->quirks[3]) ? chip8->V[0] + nnn : chip8->V[x] + nnn;
-        break;
+    case 0x05:
+        switch (instr->n)
+        {
+        case 0x0: instr->op = OP_5xy0; break;
+        case 0x2: instr->op = OP_5xy2; break;
+        case 0x3: instr->op = OP_5xy3; break;
+        }
 
-    /* RND Vx, byte (Cxkk)
-       Set Vx = random byte AND kk. */
-    case 0x0C:
-        chip8->V[x] = (rand() % 0x100) & kk;
         break;
 
-    /* DRW Vx, Vy, n (Dxyn):
-       Legacy: Display n-byte sprite starting at memory location I at (Vx, Vy),
-       set VF = collision.
-       S-CHIP: If hires=false: If n=0, display 8x16 sprite. Else:
-       Same as Legacy. If hires=true: Same as Legacy, except
-       set VF = num rows collision. If n=0: Display 16x16 sprite starting at
-       memory location I at (Vx, Vy), set VF = num rows collision. */
-    case 0x0D:
-        chip8_draw(chip8, chip8->V[x], chip8->V[y], n, chip8->bitplane);
-        break;
+    case 0x06: instr->op = OP_6xkk; break;
+    case 0x07: instr->op = OP_7xkk; break;
 
-    case 0x0E:
-        switch (b2)
+    case 0x08:
+    {
+        /* Flags that are overwritten before being read are not computed. The
+        S-CHIP 8xy1/2/3 handlers double as the legacy ones without the VF
+        reset. */
+        bool vf_dead = (instr->n >= 0x01 && instr->n <= 0x07) ||
+                       instr->n == 0x0E;
+        vf_dead = vf_dead && chip8_vf_is_dead(chip8, addr);
+        bool keep_vf = chip8->quirks[9] || vf_dead;
+
+        switch (instr->n)
         {
-        /* SKP Vx (Ex9E)
-           Skip next instruction if key with the value of Vx is pressed. */
-        case 0x9E:
-            if (chip8->keypad[chip8->V[x]] == KEY_DOWN)
+        case 0x00: instr->op = OP_8xy0; break;
+        case 0x01: instr->op = keep_vf ? OP_8xy1 : OP_8xy1_legacy; break;
+        case 0x02: instr->op = keep_vf ? OP_8xy2 : OP_8xy2_legacy; break;
+        case 0x03: instr->op = keep_vf ? OP_8xy3 : OP_8xy3_legacy; break;
+        case 0x04: instr->op = vf_dead ? OP_8xy4_no_vf : OP_8xy4; break;
+        case 0x05: instr->op = vf_dead ? OP_8xy5_no_vf : OP_8xy5; break;
+        case 0x07: instr->op = vf_dead ? OP_8xy7_no_vf : OP_8xy7; break;
+
+        case 0x06:
+            if (chip8->quirks[1])
+            {
+                instr->op = vf_dead ? OP_8xy6_no_vf : OP_8xy6;
+            }
+            else
             {
-                chip8_skip_instr(chip8);
+                instr->op = vf_dead ? OP_8xy6_legacy_no_vf : OP_8xy6_legacy;
             }
 
             break;
 
-        /* SKNP Vx (ExA1)
-           Skip next instruction if key with the value of Vx is not pressed. */
-        case 0xA1:
-            if (chip8->keypad[chip8->V[x]] == KEY_UP)
+        case 0x0E:
+            if (chip8->quirks[1])
+            {
+                instr->op = vf_dead ? OP_8xyE_no_vf : OP_8xyE;
+            }
+            else
             {
-                chip8_skip_instr(chip8);
+                instr->op = vf_dead ? OP_8xyE_legacy_no_vf : OP_8xyE_legacy;
             }
 
             break;
         }
 
+        break;
+    }
+
+    case 0x09: instr->op = OP_9xy0; break;
+    case 0x0A: instr->op = OP_Annn; break;
+    case 0x0B: instr->op = chip8->quirks[3] ? OP_Bnnn : OP_Bnnn_legacy; break;
+    case 0x0C: instr->op = OP_Cxkk; break;
+    case 0x0D: instr->op = chip8_draw_op(chip8, chip8_vf_is_dead(chip8, addr)); break;
+
+    case 0x0E:
+        switch (b2)
+        {
+        case 0x9E: instr->op = OP_Ex9E; break;
+        case 0xA1: instr->op = OP_ExA1; break;
+        }
+
         break;
 
     case 0x0F:
         switch (b2)
         {
-        /* LD I, nnnn (XO-CHIP Only)
-           Set I = 16-bit address (stored in next two bytes). */
-        case 0x00:
-            chip8->I = (chip8->RAM[chip8->PC]) << 8;
-            chip8->I |= (chip8->RAM[chip8->PC + 1]);
-            chip8->PC += 2;
-            break;
+        case 0x00: instr->op = OP_F000; break;
+        case 0x01: instr->op = OP_Fx01; break;
+        case 0x02: instr->op = OP_F002; break;
+        case 0x07: instr->op = OP_Fx07; break;
+        case 0x0A: instr->op = OP_Fx0A; break;
+        case 0x15: instr->op = OP_Fx15; break;
+        case 0x18: instr->op = OP_Fx18; break;
+        case 0x1E: instr->op = OP_Fx1E; break;
+        case 0x29: instr->op = OP_Fx29; break;
+        case 0x30: instr->op = OP_Fx30; break;
+        case 0x33: instr->op = OP_Fx33; break;
+        case 0x3A: instr->op = OP_Fx3A; break;
+        case 0x55: instr->op = chip8->quirks[2] ? OP_Fx55 : OP_Fx55_legacy; break;
+        case 0x65: instr->op = chip8->quirks[2] ? OP_Fx65 : OP_Fx65_legacy; break;
+        case 0x75: instr->op = OP_Fx75; break;
+        case 0x85: instr->op = OP_Fx85; break;
+        }
 
-        /* PLANE n (XO-CHIP Only)
-           Set the bitplane where 0 <= n <= 3. */
-        case 0x01:
-            if (x > NUM_BITPLANES)
-            {
-                x = NUM_BITPLANES;
-            }
+        break;
+    }
 
-            chip8->bitplane = (CHIP8BP) x;
-            break;
+    instr->handler = chip8_handlers[instr->op];
+}
 
-        /* AUDIO (XO-CHIP Only)
-           Store bytes starting at I in the audio pattern buffer. */
-        case 0x02:
-            for (int i = 0; i < AUDIO_BUF_SIZE; i++)
-            {
-                chip8->RAM[AUDIO_BUF_ADDR + i] = chip8->RAM[chip8->I + i];
-            }
+// Returns true if the instruction ends a basic block.
+static bool chip8_ends_block(const CHIP8_INSTR *instr)
+{
+    /* Anything that does not simply continue at the next instruction, plus
+    display changes and key waits since callers may want to stop after them.
+    Draws whose VF is dead carry on to the instruction that overwrites it. */
+    switch (instr->op)
+    {
+    case OP_0000:
+    case OP_00Cn:
+    case OP_00Dn:
+    case OP_00E0:
+    case OP_00EE:
+    case OP_00FB:
+    case OP_00FC:
+    case OP_00FD:
+    case OP_00FE:
+    case OP_00FE_legacy:
+    case OP_00FF:
+    case OP_00FF_legacy:
+    case OP_1nnn:
+    case OP_2nnn:
+    case OP_3xkk:
+    case OP_4xkk:
+    case OP_5xy0:
+    case OP_9xy0:
+    case OP_Bnnn:
+    case OP_Bnnn_legacy:
+    case OP_Dxyn:
+    case OP_Dxyn_schip:
+    case OP_Dxyn_legacy:
+    case OP_Dxyn_xochip:
+    case OP_Ex9E:
+    case OP_ExA1:
+    case OP_F000:
+    case OP_Fx0A:
+        return true;
 
-            break;
+    default:
+        return false;
+    }
+}
 
-        /* LD Vx, DT (Fx07)
-           Set Vx = delay timer value. */
-        case 0x07:
-            chip8->V[x] = chip8->DT;
-            break;
+/* Decodes the basic block starting at addr into the instruction cache and
+returns its first instruction. Blocks stop at the end of the code page. */
+static CHIP8_INSTR *chip8_translate(CHIP8 *chip8, uint16_t addr)
+{
+    CHIP8_INSTR *instr = chip8->icache->instr;
+    int page_end = ((addr / CODE_PAGE_SIZE) + 1) * CODE_PAGE_SIZE;
+    int end = addr;
+    int len = 0;
 
-        /* LD Vx, K (Fx0A)
-           Wait for a key press, store the value of the key in Vx. */
-        case 0x0A:
+    while (end < page_end)
+    {
+        // The rest of the block may already be decoded.
+        if (instr[end].handler)
         {
-            chip8_wait_key(chip8, x);
+            len = instr[end].len;
             break;
         }
 
-        /* LD DT, Vx (Fx15)
-           Set delay timer = Vx. */
-        case 0x15:
-            chip8->DT = chip8->V[x];
-            break;
+        chip8_decode(chip8, end, &instr[end]);
+        end += 2;
 
-        /* LD ST, Vx (Fx18)
-           Set sound timer = Vx. */
-        case 0x18:
-            chip8->ST = chip8->V[x];
+        if (chip8_ends_block(&instr[end - 2]))
+        {
             break;
+        }
+    }
 
-        /* ADD I, Vx (Fx1E):
-           Set I = I + Vx. */
-        case 0x1E:
-            chip8->I += chip8->V[x];
-            break;
+    for (int i = end - 2; i >= addr; i -= 2)
+    {
+        instr[i].len = ++len;
+    }
 
-        /* LD F, Vx (Fx29)
-           Set I = location of 5-byte sprite for digit Vx. */
-        case 0x29:
-            chip8->I = FONT_START_ADDR + (chip8->V[x] * 0x05);
-            break;
+    chip8->icache->page_used[addr / CODE_PAGE_SIZE] = true;
 
-        /* LD HF, Vx (Fx30) (S-CHIP Only)
-           Set I = location of 10-byte sprite for digit Vx. */
-        case 0x30:
-            chip8->I = BIG_FONT_START_ADDR + (chip8->V[x] * 0x0A);
-            break;
+    return &instr[addr];
+}
 
-        /* LD B, Vx (Fx33)
-           Store BCD representation of Vx in memory locations:
-           I, I+1, and I+2. */
-        case 0x33:
-            chip8->RAM[chip8->I] = (chip8->V[x] / 100) % 10;
-            chip8->RAM[chip8->I + 1] = (chip8->V[x] / 10) % 10;
-            chip8->RAM[chip8->I + 2] = chip8->V[x] % 10;
-            break;
+void chip8_execute(CHIP8 *chip8)
+{
+    CHIP8_INSTR uncached;
+    CHIP8_INSTR *instr = &uncached;
 
-        /* PITCH Vx (Fx3A) (XO-CHIP Only)
-           Set audio pitch to Vx. */
-        case 0x3A:
-            chip8->pitch = chip8->V[x];
-            break;
+    if (chip8->icache)
+    {
+        instr = &chip8->icache->instr[chip8->PC];
 
-        /* LD [I], Vx (Fx55)
-           Store registers V0 through Vx in memory starting at location I.
-           Legacy: Set I=I+x+1 */
-        case 0x55:
-            for (int r = 0; r <= x; r++)
-            {
-                chip8->RAM[chip8->I + r] = chip8->V[r];
-            }
+        // Only decode instructions that are not in the cache yet.
+        if (!instr->handler)
+        {
+            instr = chip8_translate(chip8, chip8->PC);
+        }
+    }
+    else
+    {
+        chip8_decode(chip8, chip8->PC, instr);
+    }
 
-            if (!chip8->quirks[2])
-            {
-                chip8->I += (x + 1);
-            }
+    /* Immediately set PC to next instruction
+    after fetching and decoding the current one. */
+    chip8->PC += 2;
 
-            break;
+    chip8_handlers[chip8_exact_op(chip8, instr->op)](chip8, instr);
 
-        /* LD Vx, [I] (Fx65)
-           Read registers V0 through Vx from memory starting at location I.
-           Legacy: Set I=I+x+1 */
-        case 0x65:
-            for (int r = 0; r <= x; r++)
-            {
-                chip8->V[r] = chip8->RAM[chip8->I + r];
-            }
+    // Any key that was released previous frame gets turned off.
+    chip8_reset_released_keys(chip8);
+}
 
-            if (!chip8->quirks[2])
-            {
-                chip8->I += (x + 1);
-            }
+int chip8_execute_block(CHIP8 *chip8, int max)
+{
+    if (max <= 0)
+    {
+        return 0;
+    }
 
-            break;
+    if (!chip8->icache)
+    {
+        chip8_execute(chip8);
+        return 1;
+    }
 
-        /* LD uflags_disk, V0..Vx (Fx75) (S-CHIP Only)
-           Save user flags to disk. */
-        case 0x75:
-            if (!chip8_handle_user_flags(chip8, x + 1, true))
-            {
-                fprintf(stderr, "Unable to save user flags to %s\n",
-                        chip8->UF_path);
-            }
+    CHIP8_INSTR *instr = &chip8->icache->instr[chip8->PC];
+    if (!instr->handler)
+    {
+        instr = chip8_translate(chip8, chip8->PC);
+    }
+
+    // A block cut short computes every VF (see chip8_vf_is_dead).
+    if (instr->len > max)
+    {
+        int executed = 0;
+        while (executed < max && instr->handler)
+        {
+            chip8->PC += 2;
+            chip8_handlers[chip8_exact_op(chip8, instr->op)](chip8, instr);
+            chip8_reset_released_keys(chip8);
+            executed++;
+            instr += 2;
+        }
+
+        return executed;
+    }
+
+    int len = instr->len;
+
+    chip8->PC += 2;
+    instr->handler(chip8, instr);
+
+    /* Released keys only have to be cleared once since nothing inside the
+    block can release them again. */
+    chip8_reset_released_keys(chip8);
 
+    int executed = 1;
+
+#ifdef CHIP8_THREADED_DISPATCH
+    /* Every handler is inlined behind its own label and jumps straight to the
+    next one, so each indirect branch gets its own prediction history. */
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+#define CHIP8_OP_LABEL(name) &&L_##name,
+#define CHIP8_OP_BODY(name) \
+    L_##name:               \
+    op_##name(chip8, instr); \
+    CHIP8_DISPATCH();
+
+    // Stop if the block was overwritten by one of its own instructions.
+#define CHIP8_DISPATCH()          \
+    if (executed >= len)          \
+    {                             \
+        goto done;                \
+    }                             \
+    instr += 2;                   \
+    if (!instr->handler)          \
+    {                             \
+        goto done;                \
+    }                             \
+    chip8->PC += 2;               \
+    executed++;                   \
+    goto *labels[instr->op];
+
+    static const void *const labels[NUM_OPS] = {
+        CHIP8_OPS(CHIP8_OP_LABEL)
+    };
+
+    CHIP8_DISPATCH();
+    CHIP8_OPS(CHIP8_OP_BODY)
+
+done:
+#undef CHIP8_DISPATCH
+#undef CHIP8_OP_BODY
+#undef CHIP8_OP_LABEL
+#pragma GCC diagnostic pop
+#else
+    while (executed < len)
+    {
+        // Stop if the block was overwritten by one of its own instructions.
+        instr += 2;
+        if (!instr->handler)
+        {
             break;
+        }
+
+        chip8->PC += 2;
+        instr->handler(chip8, instr);
+        executed++;
+    }
+#endif
+
+    return executed;
+}
+
+void chip8_invalidate_code(CHIP8 *chip8, int addr, int len)
+{
+    if (!chip8->icache || len <= 0)
+    {
+        return;
+    }
+
+    /* An instruction starting at the last byte of a page also reads the
+    first byte of the next one. */
+    int first = ((addr > 0) ? addr - 1 : 0) / CODE_PAGE_SIZE;
+    int last = (addr + len - 1) / CODE_PAGE_SIZE;
+    if (last >= NUM_CODE_PAGES)
+    {
+        last = NUM_CODE_PAGES - 1;
+    }
 
-        /* LD V0..Vx, uflags_disk (Fx85) (S-CHIP Only)
-           Load user flags from disk. */
-        case 0x85:
-            if (!chip8_handle_user_flags(chip8, x + 1, false))
+    for (int p = first; p <= last; p++)
+    {
+        if (chip8->icache->page_used[p])
+        {
+            for (int i = p * CODE_PAGE_SIZE; i < (p + 1) * CODE_PAGE_SIZE; i++)
             {
-                fprintf(stderr, "Unable to load user flags from %s\n",
-                        chip8->UF_path);
+                chip8->icache->instr[i].handler = NULL;
             }
 
-            break;
+            chip8->icache->page_used[p] = false;
         }
+    }
+}
 
-        break;
+void chip8_handle_timers(CHIP8 *chip8)
+{
+    /* Delay and sound timers only count time here. DT and ST are worked out
+    from it when they are read. Uncapped timers tick on every call. */
+    if (chip8->timer_freq)
+    {
+        chip8->timer_cum += chip8->total_cycle_time;
+    }
+    else
+    {
+        chip8_tick_timers(chip8, 1);
     }
 
-    // Any key that was released previous frame gets turned off.
-    chip8_reset_released_keys(chip8);
+    // Screen Refresh
+    chip8->display_updated = false;
+    chip8->refresh_cum += chip8->total_cycle_time;
+    if (!chip8->refresh_freq || chip8->refresh_cum >= chip8->refresh_max_cum)
+    {
+        chip8->display_updated = true;
+        chip8->refresh_cum = chip8_carry_time(chip8->refresh_cum,
+                                              chip8->refresh_max_cum);
+    }
+}
+
+void chip8_sync_timers(CHIP8 *chip8)
+{
+    if (chip8->timer_freq && chip8->timer_cum >= chip8->timer_max_cum)
+    {
+        chip8_tick_timers(chip8, chip8->timer_cum / chip8->timer_max_cum);
+        chip8->timer_cum %= chip8->timer_max_cum;
+    }
+
+    chip8->beep = (chip8->ST > 0);
+}
+
+void chip8_update_elapsed_time(CHIP8 *chip8)
+{
+#ifdef __LIBRETRO__
+    chip8->total_cycle_time = ONE_SEC / chip8->cpu_freq;
+#elif defined(WIN32)
+    chip8->prev_cycle_start = chip8->cur_cycle_start;
+
+    QueryPerformanceCounter(&chip8->cur_cycle_start);
+
+    chip8->win_cycle_time.QuadPart = chip8->cur_cycle_start.QuadPart - chip8->prev_cycle_start.QuadPart;
+
+    // Whole seconds first, as ticks * ONE_SEC would overflow after long gaps.
+    LONGLONG ticks = chip8->win_cycle_time.QuadPart;
+    LONGLONG freq = chip8->real_cpu_freq.QuadPart;
+    chip8->total_cycle_time = ticks / freq * ONE_SEC + ticks % freq * ONE_SEC / freq;
+
+    if (chip8->total_cycle_time == 0)
+    {
+        chip8->total_cycle_time = 1;
+    }
+#else
+    chip8->prev_cycle_start = chip8->cur_cycle_start;
+
+    // Monotonic, so stepping the wall clock doesn't disturb timing.
+    chip8->cur_cycle_start = chip8_clock_ns();
+    chip8->total_cycle_time = chip8->cur_cycle_start - chip8->prev_cycle_start;
+#endif
+
+    // A clock read by another process or boot can be ahead of this one.
+    if (chip8->total_cycle_time < 0)
+    {
+        chip8->total_cycle_time = 0;
+    }
+}
+
+void chip8_reset_clock(CHIP8 *chip8)
+{
+#ifndef __LIBRETRO__
+#ifdef WIN32
+    QueryPerformanceFrequency(&chip8->real_cpu_freq);
+    QueryPerformanceCounter(&chip8->cur_cycle_start);
+    QueryPerformanceCounter(&chip8->prev_cycle_start);
+#else
+    chip8->cur_cycle_start = chip8_clock_ns();
+    chip8->prev_cycle_start = chip8->cur_cycle_start;
+#endif
+#else
+    (void)chip8;
+#endif
+}
+
+void chip8_reset_keypad(CHIP8 *chip8)
+{
+    for (int k = 0; k < NUM_KEYS; k++)
+    {
+        chip8->keypad[k] = KEY_UP;
+    }
+}
+
+void chip8_reset_released_keys(CHIP8 *chip8)
+{
+    for (int k = 0; k < NUM_KEYS; k++)
+    {
+        if (chip8->keypad[k] == KEY_RELEASED)
+        {
+            chip8->keypad[k] = KEY_UP;
+        }
+    }
+}
+
+// Doubles every bit of a 32-bit value, turning lores pixels into display pixels.
+static uint64_t chip8_double_bits(uint32_t bits)
+{
+    uint64_t wide = bits;
+    wide = (wide | (wide << 16)) & 0x0000FFFF0000FFFFULL;
+    wide = (wide | (wide << 8)) & 0x00FF00FF00FF00FFULL;
+    wide = (wide | (wide << 4)) & 0x0F0F0F0F0F0F0F0FULL;
+    wide = (wide | (wide << 2)) & 0x3333333333333333ULL;
+    wide = (wide | (wide << 1)) & 0x5555555555555555ULL;
+
+    return wide | (wide << 1);
+}
+
+// Undoes chip8_double_bits, keeping the first bit of every pair.
+static uint32_t chip8_halve_bits(uint64_t bits)
+{
+    bits = (bits >> 1) & 0x5555555555555555ULL;
+    bits = (bits | (bits >> 1)) & 0x3333333333333333ULL;
+    bits = (bits | (bits >> 2)) & 0x0F0F0F0F0F0F0F0FULL;
+    bits = (bits | (bits >> 4)) & 0x00FF00FF00FF00FFULL;
+    bits = (bits | (bits >> 8)) & 0x0000FFFF0000FFFFULL;
+    bits = (bits | (bits >> 16)) & 0x00000000FFFFFFFFULL;
+
+    return (uint32_t)bits;
+}
+
+void chip8_reset_display(CHIP8 *chip8, CHIP8BP bitplane)
+{
+    if (bitplane == BPNONE)
+    {
+        return;
+    }
+
+    chip8->display_changed = true;
+    chip8->dirty_rows = DISPLAY_ALL_ROWS;
+
+    if (bitplane == BP1 || bitplane == BPBOTH)
+    {
+        memset(chip8->display, 0, sizeof(chip8->display));
+    }
+    if (bitplane == BP2 || bitplane == BPBOTH)
+    {
+        memset(chip8->display2, 0, sizeof(chip8->display2));
+    }
+
+    if (!chip8->hires)
+    {
+        chip8_pack_lores(chip8);
+    }
 }
 
-void chip8_handle_timers(CHIP8 *chip8)
+// Converts a native lores plane to display resolution.
+static void chip8_expand_plane(uint64_t display[DISPLAY_HEIGHT][DISPLAY_ROW_WORDS])
 {
-    // Delay
-    if (chip8->DT > 0)
+    // Bottom up, so no row is overwritten before it is expanded.
+    for (int y = DISPLAY_HEIGHT / 2 - 1; y >= 0; y--)
     {
-        chip8->delay_cum += chip8->total_cycle_time;
+        uint64_t left = chip8_double_bits(display[y][0] >> 32);
+        uint64_t right = chip8_double_bits((uint32_t)display[y][0]);
 
-        if (!chip8->timer_freq || chip8->delay_cum >= chip8->timer_max_cum)
-        {
-            chip8->DT--;
-            chip8->delay_cum = 0;
-        }
+        display[y * 2][0] = display[y * 2 + 1][0] = left;
+        display[y * 2][1] = display[y * 2 + 1][1] = right;
     }
+}
 
-    // Sound
-    if (chip8->ST > 0)
+static void chip8_expand_lores(CHIP8 *chip8)
+{
+    if (chip8->native_lores)
     {
-        chip8->beep = true;
-        chip8->sound_cum += chip8->total_cycle_time;
+        chip8_expand_plane(chip8->display);
+        chip8_expand_plane(chip8->display2);
+        chip8->native_lores = false;
+    }
+}
+
+// Returns true if every pixel of the plane is part of a 2x2 lores pixel.
+static bool chip8_plane_is_lores(uint64_t display[DISPLAY_HEIGHT][DISPLAY_ROW_WORDS])
+{
+    const uint64_t pair_firsts = 0xAAAAAAAAAAAAAAAAULL;
 
-        if (!chip8->timer_freq || chip8->sound_cum >= chip8->timer_max_cum)
+    for (int y = 0; y < DISPLAY_HEIGHT; y += 2)
+    {
+        for (int w = 0; w < DISPLAY_ROW_WORDS; w++)
         {
-            chip8->ST--;
-            chip8->sound_cum = 0;
+            uint64_t row = display[y][w];
+            if (row != display[y + 1][w] || ((row ^ (row << 1)) & pair_firsts))
+            {
+                return false;
+            }
         }
     }
-    else
+
+    return true;
+}
+
+// Converts a plane to a native lores image (see chip8_plane_is_lores).
+static void chip8_pack_plane(uint64_t display[DISPLAY_HEIGHT][DISPLAY_ROW_WORDS])
+{
+    for (int y = 0; y < DISPLAY_HEIGHT / 2; y++)
     {
-        chip8->beep = false;
+        uint64_t left = chip8_halve_bits(display[y * 2][0]);
+        uint64_t right = chip8_halve_bits(display[y * 2][1]);
+
+        display[y][0] = (left << 32) | right;
+        display[y][1] = 0;
     }
 
-    // Screen Refresh
-    chip8->display_updated = false;
-    chip8->refresh_cum += chip8->total_cycle_time;
-    if (!chip8->refresh_freq || chip8->refresh_cum >= chip8->refresh_max_cum)
+    memset(display[DISPLAY_HEIGHT / 2], 0,
+           (DISPLAY_HEIGHT / 2) * sizeof(display[0]));
+}
+
+/* Switches to a native lores image if both planes can be represented by one,
+which is the case after any clear. The image stays at display resolution
+otherwise, e.g. when a hires image is kept by 00FE (quirk 5). */
+static void chip8_pack_lores(CHIP8 *chip8)
+{
+    if (!chip8->native_lores && chip8_plane_is_lores(chip8->display) &&
+        chip8_plane_is_lores(chip8->display2))
     {
-        chip8->display_updated = true;
-        chip8->refresh_cum = 0;
+        chip8_pack_plane(chip8->display);
+        chip8_pack_plane(chip8->display2);
+        chip8->native_lores = true;
     }
 }
 
-void chip8_update_elapsed_time(CHIP8 *chip8)
+bool chip8_get_pixel(CHIP8 *chip8, CHIP8BP bitplane, int x, int y)
 {
-#ifdef __LIBRETRO__
-    chip8->total_cycle_time = 1000000 / chip8->cpu_freq;
-#elif defined(WIN32)
-    chip8->prev_cycle_start = chip8->cur_cycle_start;
-
-    QueryPerformanceCounter(&chip8->cur_cycle_start);
-
-    chip8->win_cycle_time.QuadPart = chip8->cur_cycle_start.QuadPart - chip8->prev_cycle_start.QuadPart;
-    chip8->win_cycle_time.QuadPart *= 1000000;
-    chip8->win_cycle_time.QuadPart /= chip8->real_cpu_freq.QuadPart;
+    if (chip8->native_lores)
+    {
+        x /= 2;
+        y /= 2;
+    }
 
-    chip8->total_cycle_time = chip8->win_cycle_time.QuadPart;
+    uint64_t bit = CHIP8_PIXEL_BIT(x);
+    bool on = false;
 
-    if (chip8->total_cycle_time == 0)
+    if (bitplane == BP1 || bitplane == BPBOTH)
     {
-        chip8->total_cycle_time = 1;
+        on |= (chip8->display[y][x / 64] & bit) != 0;
+    }
+    if (bitplane == BP2 || bitplane == BPBOTH)
+    {
+        on |= (chip8->display2[y][x / 64] & bit) != 0;
     }
-#else
-    chip8->prev_cycle_start.tv_sec = chip8->cur_cycle_start.tv_sec;
-    chip8->prev_cycle_start.tv_usec = chip8->cur_cycle_start.tv_usec;
-
-    gettimeofday(&chip8->cur_cycle_start, NULL);
 
-    // Calculate total cycle time in microseconds.
-    chip8->total_cycle_time = chip8->cur_cycle_start.tv_sec;
-    chip8->total_cycle_time -= chip8->prev_cycle_start.tv_sec;
-    chip8->total_cycle_time *= 1000000;
-    chip8->total_cycle_time += chip8->cur_cycle_start.tv_usec;
-    chip8->total_cycle_time -= chip8->prev_cycle_start.tv_usec;
-#endif
+    return on;
 }
 
-void chip8_reset_keypad(CHIP8 *chip8)
+void chip8_set_pixel(CHIP8 *chip8, CHIP8BP bitplane, int x, int y, bool on)
 {
-    for (int k = 0; k < NUM_KEYS; k++)
+    // A single display pixel may not fit a native lores image.
+    chip8_expand_lores(chip8);
+
+    uint64_t bit = CHIP8_PIXEL_BIT(x);
+
+    if (bitplane == BP1 || bitplane == BPBOTH)
     {
-        chip8->keypad[k] = KEY_UP;
+        chip8->display[y][x / 64] = on ? (chip8->display[y][x / 64] | bit)
+                                       : (chip8->display[y][x / 64] & ~bit);
     }
+    if (bitplane == BP2 || bitplane == BPBOTH)
+    {
+        chip8->display2[y][x / 64] = on ? (chip8->display2[y][x / 64] | bit)
+                                        : (chip8->display2[y][x / 64] & ~bit);
+    }
+
+    chip8->dirty_rows |= 1ULL << y;
 }
 
-void chip8_reset_released_keys(CHIP8 *chip8)
+void chip8_get_display_row(CHIP8 *chip8, CHIP8BP bitplane, int y,
+                           uint64_t row[DISPLAY_ROW_WORDS])
 {
-    for (int k = 0; k < NUM_KEYS; k++)
+    int r = chip8->native_lores ? y / 2 : y;
+
+    for (int w = 0; w < DISPLAY_ROW_WORDS; w++)
     {
-        if (chip8->keypad[k] == KEY_RELEASED)
+        row[w] = 0;
+        if (bitplane == BP1 || bitplane == BPBOTH)
         {
-            chip8->keypad[k] = KEY_UP;
+            row[w] |= chip8->display[r][w];
+        }
+        if (bitplane == BP2 || bitplane == BPBOTH)
+        {
+            row[w] |= chip8->display2[r][w];
         }
     }
-}
 
-void chip8_reset_display(CHIP8 *chip8, CHIP8BP bitplane)
-{
-    if (bitplane == BPNONE)
+    if (chip8->native_lores)
     {
-        return;
+        row[1] = chip8_double_bits((uint32_t)row[0]);
+        row[0] = chip8_double_bits(row[0] >> 32);
     }
+}
 
-    for (int y = 0; y < DISPLAY_HEIGHT; y++)
-    {
-        for (int x = 0; x < DISPLAY_WIDTH; x++)
-        {
-            if (bitplane == BP1 || bitplane == BPBOTH)
-            {
-                chip8->display[y][x] = false;
-            }
-            if (bitplane == BP2 || bitplane == BPBOTH)
-            {
-                chip8->display2[y][x] = false;
-            }
-        }
-    }
+uint64_t chip8_get_dirty_rows(CHIP8 *chip8)
+{
+    return chip8->dirty_rows;
+}
+
+void chip8_clear_dirty_rows(CHIP8 *chip8)
+{
+    chip8->dirty_rows = 0;
+}
+
+void chip8_invalidate_display(CHIP8 *chip8)
+{
+    chip8->dirty_rows = DISPLAY_ALL_ROWS;
 }
 
 void chip8_reset_RAM(CHIP8 *chip8)
@@ -898,6 +2116,8 @@ void chip8_reset_RAM(CHIP8 *chip8)
     {
         chip8->RAM[i] = 0x00;
     }
+
+    chip8_invalidate_code(chip8, 0, MAX_RAM);
 }
 
 void chip8_reset_registers(CHIP8 *chip8)
@@ -921,24 +2141,152 @@ void chip8_reset_audio(CHIP8 *chip8)
             chip8->RAM[i] = 0xFF;
         }
     }
+
+    chip8_invalidate_code(chip8, AUDIO_BUF_ADDR, AUDIO_BUF_SIZE);
 }
 
 void chip8_load_instr(CHIP8 *chip8, uint16_t instr)
 {
     chip8->RAM[chip8->pc_start_addr] = instr >> 8;
     chip8->RAM[chip8->pc_start_addr + 1] = instr & 0x00FF;
+    chip8_invalidate_code(chip8, chip8->pc_start_addr, 2);
 }
 
-void chip8_draw(CHIP8 *chip8, uint8_t x, uint8_t y, uint8_t n, CHIP8BP bitplane)
+/* Places a row of sprite pixels (the lowest width bits of bits, leftmost
+pixel first) on a display row starting at column x, returning the mask of
+the pixels it covers. Pixels past the right edge wrap around or get
+clipped. Rows of a native lores image are 64 pixels wide, in the first word. */
+static CHIP8_ALWAYS_INLINE void chip8_sprite_mask(uint32_t bits, int width,
+                                                  int x, bool clip, bool native,
+                                                  uint64_t mask[DISPLAY_ROW_WORDS])
+{
+    uint64_t row = (uint64_t)bits << (64 - width);
+
+    if (native)
+    {
+        mask[0] = (row >> x) | ((!clip && x) ? row << (64 - x) : 0);
+        mask[1] = 0;
+    }
+    else if (x < 64)
+    {
+        mask[0] = row >> x;
+        mask[1] = x ? row << (64 - x) : 0;
+    }
+    else
+    {
+        mask[0] = (!clip && x > 64) ? row << (128 - x) : 0;
+        mask[1] = row >> (x - 64);
+    }
+}
+
+/* Reads the pixels of a sprite row starting at addr (two bytes for wide
+sprites), doubling them in lores. */
+static CHIP8_ALWAYS_INLINE uint32_t chip8_sprite_row(CHIP8 *chip8,
+                                                     uint16_t addr, bool wide,
+                                                     int scale)
+{
+    uint32_t bits = chip8->RAM[addr];
+    if (wide)
+    {
+        bits = (bits << 8) | chip8->RAM[(uint16_t)(addr + 1)];
+    }
+
+    return (scale == 2) ? (uint32_t)chip8_double_bits(bits) : bits;
+}
+
+/* XORs a row of sprite pixels onto a display row. Returns true if any pixel
+that was on got erased. */
+static CHIP8_ALWAYS_INLINE bool chip8_xor_row(uint64_t row[DISPLAY_ROW_WORDS],
+                                              const uint64_t mask[DISPLAY_ROW_WORDS])
+{
+    bool collide = ((row[0] & mask[0]) | (row[1] & mask[1])) != 0;
+    row[0] ^= mask[0];
+    row[1] ^= mask[1];
+
+    return collide;
+}
+
+/* Draws a sprite that fits on the display without wrapping or clipping, in
+hires or on a native lores image. Always inlined with constant shapes, giving
+kernels for 8xN and 16x16 sprites on one plane and for both planes at once
+(the second plane's data starting plane2_offset bytes after the first's). */
+static CHIP8_ALWAYS_INLINE void chip8_draw_fitted(CHIP8 *chip8, bool wide,
+                                                  bool both_planes,
+                                                  CHIP8BP bitplane, int height,
+                                                  int plane2_offset, int x,
+                                                  int y, bool native,
+                                                  bool count_collisions,
+                                                  bool set_vf)
 {
-    // This function is ugly and could probably use some refactoring...
+    uint64_t (*plane)[DISPLAY_ROW_WORDS] = (bitplane == BP2) ? chip8->display2
+                                                              : chip8->display;
+    int width = wide ? 16 : 8;
+
+    for (int i = 0; i < height; i++)
+    {
+        uint64_t mask[DISPLAY_ROW_WORDS];
+        uint16_t addr = chip8->I + (wide ? i * 2 : i);
+        chip8_sprite_mask(chip8_sprite_row(chip8, addr, wide, 1), width, x,
+                          true, native, mask);
+        bool collide = chip8_xor_row(plane[y + i], mask);
+
+        if (both_planes)
+        {
+            chip8_sprite_mask(chip8_sprite_row(chip8, addr + plane2_offset,
+                                               wide, 1),
+                              width, x, true, native, mask);
+            collide |= chip8_xor_row(chip8->display2[y + i], mask);
+        }
+
+        if (set_vf && collide)
+        {
+            if (chip8->hires && count_collisions)
+            {
+                chip8->V[0x0F]++;
+            }
+            else
+            {
+                chip8->V[0x0F] = 1;
+            }
+        }
+    }
+
+    // Native lores rows cover two display rows.
+    uint64_t dirty = native ? ((1ULL << (height * 2)) - 1) << (y * 2)
+                            : ((1ULL << height) - 1) << y;
+    chip8->dirty_rows |= dirty;
+}
 
+/* Draws with the given values of quirks 4, 6, 7 and 8. Always inlined so each
+quirk profile gets its own copy with the quirk checks folded away. Without
+set_vf neither collisions nor VF are touched, for draws whose VF is
+overwritten before anything reads it. */
+static CHIP8_ALWAYS_INLINE void chip8_draw_quirks(CHIP8 *chip8, uint8_t x,
+                                                  uint8_t y, uint8_t n,
+                                                  CHIP8BP bitplane,
+                                                  bool big_sprite_lores,
+                                                  bool clip,
+                                                  bool count_collisions,
+                                                  bool bottom_collision,
+                                                  bool set_vf)
+{
     if (bitplane == BPNONE)
     {
         return;
     }
 
-    chip8->V[0x0F] = 0;
+    chip8->display_changed = true;
+
+    if (chip8->native_lores && chip8->hires)
+    {
+        chip8_expand_lores(chip8);
+    }
+
+    if (set_vf)
+    {
+        chip8->V[0x0F] = 0;
+    }
+
     int rows;
 
     /* n==0 only has signifigance in S-CHIP mode,
@@ -947,189 +2295,352 @@ void chip8_draw(CHIP8 *chip8, uint8_t x, uint8_t y, uint8_t n, CHIP8BP bitplane)
     {
         /* Draw a 32-byte (16x16) sprite in hires or
         a 16-byte (8x16) sprite in lores. */
-        n = (chip8->hires || !chip8->quirks[4]) ? 32 : 16;
+        n = (chip8->hires || !big_sprite_lores) ? 32 : 16;
     }
 
-    if (chip8->hires && chip8->quirks[8])
+    if (chip8->hires && bottom_collision)
     {
         rows = (n == 32) ? 16 : n;
-        chip8->V[0x0F] += ((y + rows) - (DISPLAY_HEIGHT - 1));
+        if (set_vf)
+        {
+            chip8->V[0x0F] += ((y + rows) - (DISPLAY_HEIGHT - 1));
+        }
     }
     else
     {
         rows = n;
     }
 
-    /*// Allow out-of-bound sprite to wrap-around.
-    if (!chip8->quirks[6])
+    /* A 32-byte sprite is 16 pixels wide, with every odd byte drawn to the
+    right of the previous one. The second plane's data starts rows bytes
+    after the first plane's. */
+    bool wide = (n == 32);
+    int height = wide ? 16 : n;
+    int width = wide ? 16 : 8;
+    bool native = chip8->native_lores;
+    int disp_width = native ? DISPLAY_WIDTH / 2 : DISPLAY_WIDTH;
+    int disp_height = native ? DISPLAY_HEIGHT / 2 : DISPLAY_HEIGHT;
+
+    // Lores pixels are 2x2 display pixels unless the image is native lores.
+    int scale = (chip8->hires || native) ? 1 : 2;
+    int disp_x = x * scale;
+    if (!clip)
+    {
+        disp_x %= disp_width;
+    }
+    else if (disp_x >= disp_width)
+    {
+        return;
+    }
+
+    // Sprites that need no wrapping, clipping or doubling go to a kernel.
+    if (scale == 1 && disp_x + width <= disp_width && y + height <= disp_height)
     {
-        y %= DISPLAY_HEIGHT;
-        x %= DISPLAY_WIDTH;
-    }*/
+        if (bitplane == BPBOTH && wide)
+        {
+            chip8_draw_fitted(chip8, true, true, BP1, 16, rows, disp_x, y,
+                              native, count_collisions, set_vf);
+        }
+        else if (bitplane == BPBOTH)
+        {
+            chip8_draw_fitted(chip8, false, true, BP1, height, rows, disp_x, y,
+                              native, count_collisions, set_vf);
+        }
+        else if (wide)
+        {
+            chip8_draw_fitted(chip8, true, false, bitplane, 16, 0, disp_x, y,
+                              native, count_collisions, set_vf);
+        }
+        else
+        {
+            chip8_draw_fitted(chip8, false, false, bitplane, height, 0, disp_x,
+                              y, native, count_collisions, set_vf);
+        }
 
-    bool prev_byte_collide = false;
+        return;
+    }
 
-    for (int i = 0; i < n; i++)
+    for (int i = 0; i < height; i++)
     {
-        bool collide_row = false;
+        uint64_t mask1[DISPLAY_ROW_WORDS], mask2[DISPLAY_ROW_WORDS] = {0};
+        uint16_t addr = chip8->I + (wide ? i * 2 : i);
+        chip8_sprite_mask(chip8_sprite_row(chip8, addr, wide, scale),
+                          width * scale, disp_x, clip, native, mask1);
+        if (bitplane == BPBOTH)
+        {
+            chip8_sprite_mask(chip8_sprite_row(chip8, addr + rows, wide, scale),
+                              width * scale, disp_x, clip, native, mask2);
+        }
 
-        for (int j = 0; j < 8; j++)
+        bool collide = false;
+        for (int h = 0; h < scale; h++)
         {
-            /* For big sprites, every odd byte needs to be drawn on the same
-            row as the previous byte. This is achieved through integer division
-            truncation. The odd byte also needs to be drawn 8 pixels to the
-            right of the previous byte. */
-            unsigned y_start = (n == 32) ? (i / 2) : i;
-            unsigned x_start = (n == 32 && (i % 2 != 0)) ? (j + 8) : j;
-
-            /* Now we have to scale the display if we are in lo-res mode
-            by basically drawing each pixel twice. */
-            int scale = chip8->hires ? 1 : 2;
-            for (int h = 0; h < scale; h++)
+            int disp_y = ((y + i) * scale) + h;
+            if (!clip)
+            {
+                disp_y %= disp_height;
+            }
+            else if (disp_y >= disp_height)
+            {
+                break;
+            }
+
+            chip8->dirty_rows |= native ? (3ULL << (disp_y * 2))
+                                        : (1ULL << disp_y);
+
+            if (bitplane == BP1 || bitplane == BPBOTH)
+            {
+                collide |= chip8_xor_row(chip8->display[disp_y], mask1);
+            }
+            if (bitplane == BP2)
+            {
+                collide |= chip8_xor_row(chip8->display2[disp_y], mask1);
+            }
+            if (bitplane == BPBOTH)
             {
-                for (int k = 0; k < scale; k++)
-                {
-                    int disp_x = (x * scale) + (x_start * scale) + k;
-                    int disp_y = (y * scale) + (y_start * scale) + h;
-
-                    if (!chip8->quirks[6])
-                    {
-                        disp_y %= DISPLAY_HEIGHT;
-                        disp_x %= DISPLAY_WIDTH;
-                    }
-                    else if (disp_x >= DISPLAY_WIDTH || disp_y >= DISPLAY_HEIGHT)
-                    {
-                        break;
-                    }
-
-                    bool pixel_on = false;
-                    bool bit = false;
-                    bool collide = false;
-
-                    /* Get the pixel the loop is on and the corresponding bit
-                    and XOR them onto display. If a pixel is erased, set the VF
-                    register to 1. */
-                    if (bitplane == BP1 || bitplane == BPBOTH)
-                    {
-                        pixel_on = chip8->display[disp_y][disp_x];
-                        bit = (chip8->RAM[chip8->I + i] >> (7 - j)) & 0x01;
-                        collide = pixel_on && bit;
-                        chip8->display[disp_y][disp_x] = (pixel_on ^ bit);
-                    }
-                    if (bitplane == BP2)
-                    {
-                        pixel_on = chip8->display2[disp_y][disp_x];
-                        bit = (chip8->RAM[chip8->I + i] >> (7 - j)) & 0x01;
-                        collide = pixel_on && bit;
-                        chip8->display2[disp_y][disp_x] = (pixel_on ^ bit);
-                    }
-                    if (bitplane == BPBOTH)
-                    {
-                        pixel_on = chip8->display2[disp_y][disp_x];
-                        bit = (chip8->RAM[chip8->I + rows + i] >> (7 - j)) & 0x01;
-                        chip8->display2[disp_y][disp_x] = (pixel_on ^ bit);
-
-                        if (!collide)
-                        {
-                            collide = pixel_on && bit;
-                        }
-                    }
-
-                    if (collide)
-                    {
-                        if (chip8->hires && chip8->quirks[7])
-                        {
-                            if (!collide_row)
-                            {
-                                if (n <= 16 || (((i % 2 == 0) && n == 32) ||
-                                                !prev_byte_collide))
-                                {
-                                    chip8->V[0x0F]++;
-                                    collide_row = true;
-                                }
-                            }
-                        }
-                        else
-                        {
-                            chip8->V[0x0F] = 1;
-                        }
-                    }
-                }
+                collide |= chip8_xor_row(chip8->display2[disp_y], mask2);
             }
         }
 
-        prev_byte_collide = collide_row;
+        /* Only an AND is needed: quirk 7 counts the rows with a collision
+        rather than the pixels. */
+        if (set_vf && collide)
+        {
+            if (chip8->hires && count_collisions)
+            {
+                chip8->V[0x0F]++;
+            }
+            else
+            {
+                chip8->V[0x0F] = 1;
+            }
+        }
     }
 }
 
-void chip8_scroll(CHIP8 *chip8, int xdir, int ydir, int num_pixels, CHIP8BP bitplane)
+void chip8_draw(CHIP8 *chip8, uint8_t x, uint8_t y, uint8_t n, CHIP8BP bitplane)
 {
-    if (bitplane == BPNONE)
+    chip8_draw_quirks(chip8, x, y, n, bitplane, chip8->quirks[4],
+                      chip8->quirks[6], chip8->quirks[7], chip8->quirks[8],
+                      true);
+}
+
+static void chip8_draw_no_vf(CHIP8 *chip8, uint8_t x, uint8_t y, uint8_t n,
+                             CHIP8BP bitplane)
+{
+    chip8_draw_quirks(chip8, x, y, n, bitplane, chip8->quirks[4],
+                      chip8->quirks[6], chip8->quirks[7], chip8->quirks[8],
+                      false);
+}
+
+#define CHIP8_DRAW_PROFILE(name, q4, q6, q7, q8)                            \
+    static void chip8_draw_##name(CHIP8 *chip8, uint8_t x, uint8_t y,       \
+                                  uint8_t n, CHIP8BP bitplane)              \
+    {                                                                       \
+        chip8_draw_quirks(chip8, x, y, n, bitplane, q4, q6, q7, q8, true);  \
+    }                                                                       \
+                                                                            \
+    static void chip8_draw_##name##_no_vf(CHIP8 *chip8, uint8_t x,          \
+                                          uint8_t y, uint8_t n,             \
+                                          CHIP8BP bitplane)                 \
+    {                                                                       \
+        chip8_draw_quirks(chip8, x, y, n, bitplane, q4, q6, q7, q8, false); \
+    }
+
+CHIP8_DRAW_PROFILES(CHIP8_DRAW_PROFILE)
+
+/* Shifts a row of pixels by num_pixels to the right (dir 1) or left
+(dir -1). */
+static void chip8_shift_row(uint64_t row[DISPLAY_ROW_WORDS], int dir,
+                            int num_pixels)
+{
+    if (num_pixels >= DISPLAY_WIDTH)
     {
+        row[0] = row[1] = 0;
         return;
     }
 
-    int x_start = 0;
-    int x_end = DISPLAY_WIDTH;
-    int y_start = 0;
-    int y_end = DISPLAY_HEIGHT;
-
-    if (xdir == 1)
+    if (num_pixels >= 64)
     {
-        x_end = DISPLAY_WIDTH - num_pixels;
+        row[(dir == 1) ? 1 : 0] = row[(dir == 1) ? 0 : 1];
+        row[(dir == 1) ? 0 : 1] = 0;
+        num_pixels -= 64;
     }
-    else if (xdir == -1)
+
+    if (num_pixels == 0)
     {
-        x_start = num_pixels;
+        return;
     }
-    if (ydir == 1)
+
+    if (dir == 1)
     {
-        y_end = DISPLAY_HEIGHT - num_pixels;
+        row[1] = (row[1] >> num_pixels) | (row[0] << (64 - num_pixels));
+        row[0] >>= num_pixels;
     }
-    else if (ydir == -1)
+    else
     {
-        y_start = num_pixels;
+        row[0] = (row[0] << num_pixels) | (row[1] >> (64 - num_pixels));
+        row[1] <<= num_pixels;
     }
+}
 
-    // Create updated display buffers.
-    uint8_t disp_buf[DISPLAY_HEIGHT][DISPLAY_WIDTH];
-    uint8_t disp_buf2[DISPLAY_HEIGHT][DISPLAY_WIDTH];
-    for (int i = 0; i < DISPLAY_HEIGHT; i++)
+/* Shifts every row of a bitplane by 0 < num_pixels < 64 to the right (dir 1)
+or left (dir -1). Each row is a funnel shift of its two words: the bits shifted
+out of one word are shifted into the other. */
+#if defined(__AVX2__)
+static void chip8_shift_rows(uint64_t display[DISPLAY_HEIGHT][DISPLAY_ROW_WORDS],
+                             int dir, int num_pixels)
+{
+    // Two rows per vector, one in each 128-bit lane.
+    __m128i shift = _mm_cvtsi32_si128(num_pixels);
+    __m128i carry_shift = _mm_cvtsi32_si128(64 - num_pixels);
+
+    for (int y = 0; y < DISPLAY_HEIGHT; y += 2)
     {
-        for (int j = 0; j < DISPLAY_WIDTH; j++)
+        __m256i rows = _mm256_loadu_si256((__m256i *)display[y]);
+        if (dir == 1)
+        {
+            __m256i carry = _mm256_sll_epi64(rows, carry_shift);
+            rows = _mm256_or_si256(_mm256_srl_epi64(rows, shift),
+                                   _mm256_slli_si256(carry, 8));
+        }
+        else
         {
-            disp_buf[i][j] = false;
-            disp_buf2[i][j] = false;
+            __m256i carry = _mm256_srl_epi64(rows, carry_shift);
+            rows = _mm256_or_si256(_mm256_sll_epi64(rows, shift),
+                                   _mm256_srli_si256(carry, 8));
         }
+        _mm256_storeu_si256((__m256i *)display[y], rows);
     }
+}
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+static void chip8_shift_rows(uint64_t display[DISPLAY_HEIGHT][DISPLAY_ROW_WORDS],
+                             int dir, int num_pixels)
+{
+    __m128i shift = _mm_cvtsi32_si128(num_pixels);
+    __m128i carry_shift = _mm_cvtsi32_si128(64 - num_pixels);
 
-    for (int y = y_start; y < y_end; y++)
+    for (int y = 0; y < DISPLAY_HEIGHT; y++)
     {
-        for (int x = x_start; x < x_end; x++)
+        __m128i row = _mm_loadu_si128((__m128i *)display[y]);
+        if (dir == 1)
         {
-            int buf_y = y + (ydir * num_pixels);
-            int buf_x = x + (xdir * num_pixels);
-
-            disp_buf[buf_y][buf_x] = chip8->display[y][x];
-            disp_buf2[buf_y][buf_x] = chip8->display2[y][x];
+            __m128i carry = _mm_sll_epi64(row, carry_shift);
+            row = _mm_or_si128(_mm_srl_epi64(row, shift),
+                               _mm_slli_si128(carry, 8));
+        }
+        else
+        {
+            __m128i carry = _mm_srl_epi64(row, carry_shift);
+            row = _mm_or_si128(_mm_sll_epi64(row, shift),
+                               _mm_srli_si128(carry, 8));
         }
+        _mm_storeu_si128((__m128i *)display[y], row);
     }
-
-    // Copy updated display buffer into actual display.
+}
+#else
+static void chip8_shift_rows(uint64_t display[DISPLAY_HEIGHT][DISPLAY_ROW_WORDS],
+                             int dir, int num_pixels)
+{
     for (int y = 0; y < DISPLAY_HEIGHT; y++)
     {
-        for (int x = 0; x < DISPLAY_WIDTH; x++)
+        uint64_t *row = display[y];
+        if (dir == 1)
         {
-            if (bitplane == BP1 || bitplane == BPBOTH)
+            row[1] = (row[1] >> num_pixels) | (row[0] << (64 - num_pixels));
+            row[0] >>= num_pixels;
+        }
+        else
+        {
+            row[0] = (row[0] << num_pixels) | (row[1] >> (64 - num_pixels));
+            row[1] <<= num_pixels;
+        }
+    }
+}
+#endif
+
+/* Scrolls one bitplane in place. A native lores image covers half of the rows
+and columns, so it scrolls by half the number of pixels. */
+static void chip8_scroll_plane(uint64_t display[DISPLAY_HEIGHT][DISPLAY_ROW_WORDS],
+                               int xdir, int ydir, int num_pixels, bool native)
+{
+    int height = native ? DISPLAY_HEIGHT / 2 : DISPLAY_HEIGHT;
+    if (native)
+    {
+        num_pixels /= 2;
+    }
+
+    if (ydir != 0)
+    {
+        int moved = (num_pixels < height) ? num_pixels : height;
+        int kept = height - moved;
+        int from = (ydir == 1) ? 0 : moved;
+        int to = (ydir == 1) ? moved : 0;
+        int cleared = (ydir == 1) ? 0 : kept;
+
+        memmove(display[to], display[from], kept * sizeof(display[0]));
+        memset(display[cleared], 0, moved * sizeof(display[0]));
+    }
+
+    if (xdir != 0 && native)
+    {
+        for (int y = 0; y < height; y++)
+        {
+            uint64_t row = display[y][0];
+            if (num_pixels >= 64)
             {
-                chip8->display[y][x] = disp_buf[y][x];
+                display[y][0] = 0;
             }
-            if (bitplane == BP2 || bitplane == BPBOTH)
+            else
             {
-                chip8->display2[y][x] = disp_buf2[y][x];
+                display[y][0] = (xdir == 1) ? row >> num_pixels
+                                            : row << num_pixels;
             }
         }
     }
+    else if (xdir != 0 && num_pixels < 64)
+    {
+        chip8_shift_rows(display, xdir, num_pixels);
+    }
+    else if (xdir != 0)
+    {
+        for (int y = 0; y < DISPLAY_HEIGHT; y++)
+        {
+            chip8_shift_row(display[y], xdir, num_pixels);
+        }
+    }
+}
+
+void chip8_scroll(CHIP8 *chip8, int xdir, int ydir, int num_pixels, CHIP8BP bitplane)
+{
+    if (bitplane == BPNONE)
+    {
+        return;
+    }
+
+    chip8->display_changed = true;
+    if (num_pixels <= 0)
+    {
+        return;
+    }
+
+    chip8->dirty_rows = DISPLAY_ALL_ROWS;
+
+    // Scrolling by an odd number of display pixels splits lores pixels.
+    if (chip8->native_lores && (chip8->hires || num_pixels % 2))
+    {
+        chip8_expand_lores(chip8);
+    }
+
+    bool native = chip8->native_lores;
+    if (bitplane == BP1 || bitplane == BPBOTH)
+    {
+        chip8_scroll_plane(chip8->display, xdir, ydir, num_pixels, native);
+    }
+    if (bitplane == BP2 || bitplane == BPBOTH)
+    {
+        chip8_scroll_plane(chip8->display2, xdir, ydir, num_pixels, native);
+    }
 }
 
 void chip8_wait_key(CHIP8 *chip8, uint8_t x)
@@ -1146,6 +2657,8 @@ void chip8_wait_key(CHIP8 *chip8, uint8_t x)
         }
     }
 
+    // Stay on this instruction until a key is released.
+    chip8->waiting = !key_released;
     if (!key_released)
     {
         chip8->PC -= 2;
@@ -1176,11 +2689,26 @@ bool chip8_load_dump(CHIP8 *chip8, char *filename)
     FILE *dmp = fopen(filename, "rb");
     if (dmp)
     {
+        // The dump holds a stale pointer, so keep our own instruction cache.
+        CHIP8_ICACHE *icache = chip8->icache;
+
         size_t fr = fread(chip8, sizeof(CHIP8), 1, dmp);
         (void)fr; // Just to suppress fread unused return value warning.
 
         fclose(dmp);
 
+        chip8->icache = icache;
+        if (!chip8->icache)
+        {
+            chip8->icache = calloc(1, sizeof(CHIP8_ICACHE));
+        }
+
+        chip8_invalidate_code(chip8, 0, MAX_RAM);
+        chip8_invalidate_display(chip8);
+
+        // The dump's clock readings come from when it was saved.
+        chip8_reset_clock(chip8);
+
         return true;
     }
 
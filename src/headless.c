@@ -0,0 +1,423 @@
+#define ALLOW_GETOPTS
+#ifdef ALLOW_GETOPTS
+#include <unistd.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include "chip8.h"
+
+#define FNV_OFFSET_BASIS 0xCBF29CE484222325ULL
+#define FNV_PRIME 0x100000001B3ULL
+#define INPUT_LINE_MAX 256
+
+// A key press or release read from the input script.
+typedef struct
+{
+    unsigned long frame;
+    unsigned key;
+    bool down;
+} KEY_EVENT;
+
+// Emulator
+CHIP8 chip8;
+char ROM_path[MAX_FILEPATH_LEN];
+uint16_t pc_start_addr = PC_START_ADDR_DEFAULT;
+unsigned long cpu_freq = CPU_FREQ_DEFAULT;
+unsigned long timer_freq = TIMER_FREQ_DEFAULT;
+unsigned long refresh_freq = REFRESH_FREQ_DEFAULT;
+unsigned long ipf = 0;
+bool calibrate = false;
+bool quirks[NUM_QUIRKS] = {1, 1, 1, 1, 1, 1, 1, 1, 1, 1};
+bool load_dmp = false;
+
+// Run
+unsigned long max_frames = 0;
+unsigned long max_instructions = 0;
+uint32_t seed = 0;
+bool seed_given = false;
+FILE *input_file = NULL;
+
+// Checks and processes command-line arguments.
+bool handle_args(int argc, char **argv)
+{
+    if (argc < 2)
+    {
+        fprintf(stderr, "Usage: ./jaxe-headless [options] <path-to-ROM>\n");
+        return false;
+    }
+
+    if (strlen(argv[argc - 1]) >= MAX_FILEPATH_LEN)
+    {
+        fprintf(stderr, "ROM path must be less than %d characters.\n",
+                MAX_FILEPATH_LEN);
+        return false;
+    }
+
+    sprintf(ROM_path, "%s", argv[argc - 1]);
+
+#ifdef ALLOW_GETOPTS
+    int opt;
+    while ((opt = getopt(argc, argv, "0123456789xlmap:c:t:r:i:F:I:K:S:")) != -1)
+    {
+        switch (opt)
+        {
+        // Toggle specific S-CHIP "quirks"
+        case '0':
+        case '1':
+        case '2':
+        case '3':
+        case '4':
+        case '5':
+        case '6':
+        case '7':
+        case '8':
+        case '9':
+            quirks[opt - '0'] = false;
+            break;
+
+        // Toggle legacy mode
+        case 'l':
+            for (size_t i = 0; i < NUM_QUIRKS; i++)
+            {
+                quirks[i] = false;
+            }
+
+            // Both CHIP-8 and SCHIP apparently clip sprites (but not XO-CHIP)
+            quirks[6] = true;
+
+            break;
+
+        // Toggle XO-CHIP mode
+        case 'x':
+            for (size_t i = 0; i < NUM_QUIRKS - 1; i++)
+            {
+                quirks[i] = false;
+            }
+            break;
+
+        // Specify to emulator to load dump file as opposed to ROM
+        case 'm':
+            load_dmp = true;
+            break;
+
+        // Set the address emulator begins executing at
+        case 'p':
+            pc_start_addr = strtol(optarg, NULL, 16);
+            break;
+
+        // Set CPU frequency
+        case 'c':
+            cpu_freq = atoi(optarg);
+            break;
+
+        // Set timer frequency
+        case 't':
+            timer_freq = atoi(optarg);
+            break;
+
+        // Set screen refresh frequency
+        case 'r':
+            refresh_freq = atoi(optarg);
+            break;
+
+        // Pick the CPU frequency (or IPF) the host can sustain
+        case 'a':
+            calibrate = true;
+            break;
+
+        // Set the number of instructions per frame (IPF mode)
+        case 'i':
+            ipf = strtoul(optarg, NULL, 10);
+            break;
+
+        // Set the number of frames to run
+        case 'F':
+            max_frames = strtoul(optarg, NULL, 10);
+            break;
+
+        // Set the number of instructions to run
+        case 'I':
+            max_instructions = strtoul(optarg, NULL, 10);
+            break;
+
+        // Set the input script
+        case 'K':
+            input_file = fopen(optarg, "r");
+            if (!input_file)
+            {
+                fprintf(stderr, "Unable to open input file %s\n", optarg);
+                return false;
+            }
+
+            break;
+
+        // Set the seed of the random number generator
+        case 'S':
+            seed = strtoul(optarg, NULL, 0);
+            seed_given = true;
+            break;
+
+        default:
+            return false;
+        }
+    }
+#endif
+
+    if (!max_frames && !max_instructions)
+    {
+        fprintf(stderr, "Give a number of frames (-F) or instructions (-I).\n");
+        return false;
+    }
+
+    return true;
+}
+
+/* Measures how fast the host runs the ROM, prints the results and switches to
+the fastest speed that leaves headroom in each frame. */
+bool calibrate_speed()
+{
+    CHIP8_CALIBRATION cal;
+    if (!chip8_calibrate(&chip8, CALIBRATION_TIME_DEFAULT,
+                         CALIBRATION_HEADROOM_DEFAULT, &cal))
+    {
+        fprintf(stderr, "Unable to calibrate, the ROM stopped right away.\n");
+        return false;
+    }
+
+    printf("calibration:  %lu instructions in %.3f s (%.1f M instructions/s)\n",
+           cal.instructions, cal.seconds, cal.instructions_per_sec / 1e6);
+    printf("tuned speed:  %lu Hz (%lu IPF), %.3f ms per frame\n",
+           cal.cpu_freq, cal.ipf, cal.frame_time * 1e3);
+
+    if (chip8.ipf)
+    {
+        chip8_set_ipf(&chip8, cal.ipf);
+    }
+    else
+    {
+        chip8_set_cpu_freq(&chip8, cal.cpu_freq);
+    }
+
+    return true;
+}
+
+// Set up the emulator to begin running.
+bool init_emulator()
+{
+    if (!load_dmp)
+    {
+        chip8_init(&chip8, cpu_freq, timer_freq, refresh_freq, pc_start_addr,
+                   quirks);
+        chip8_load_font(&chip8);
+
+        if (!chip8_load_rom(&chip8, ROM_path))
+        {
+            return false;
+        }
+
+        // Runs are reproducible unless asked otherwise.
+        chip8_seed(&chip8, seed);
+    }
+    else
+    {
+        if (!chip8_load_dump(&chip8, ROM_path))
+        {
+            return false;
+        }
+
+        if (seed_given)
+        {
+            chip8_seed(&chip8, seed);
+        }
+    }
+
+    if (ipf)
+    {
+        chip8_set_ipf(&chip8, ipf);
+    }
+
+    if (calibrate && !calibrate_speed())
+    {
+        return false;
+    }
+
+    if ((!chip8.cpu_freq && !chip8.ipf) || !chip8.refresh_freq)
+    {
+        fprintf(stderr, "CPU and refresh frequencies must not be uncapped.\n");
+        return false;
+    }
+
+    return true;
+}
+
+/* Reads the next event of the input script. Each line holds a frame number,
+a key (in hex) and either "down" or "up", e.g. "120 A down". Lines must be
+sorted by frame. Empty lines and lines starting with # are ignored. */
+bool read_key_event(KEY_EVENT *event)
+{
+    char line[INPUT_LINE_MAX];
+    while (input_file && fgets(line, sizeof(line), input_file))
+    {
+        char action[8];
+        if (line[0] == '#' ||
+            sscanf(line, "%lu %x %7s", &event->frame, &event->key, action) != 3)
+        {
+            continue;
+        }
+
+        if (event->key >= NUM_KEYS)
+        {
+            fprintf(stderr, "Ignoring bad key in input: %s", line);
+            continue;
+        }
+
+        event->down = (strcmp(action, "down") == 0);
+        return true;
+    }
+
+    return false;
+}
+
+// Applies a scripted key event the same way the SDL frontend does.
+void handle_key_event(const KEY_EVENT *event)
+{
+    chip8.keypad[event->key] = event->down ? KEY_DOWN : KEY_RELEASED;
+}
+
+// Hashes len bytes into hash (FNV-1a).
+uint64_t hash_bytes(uint64_t hash, const void *data, size_t len)
+{
+    const uint8_t *bytes = data;
+    for (size_t i = 0; i < len; i++)
+    {
+        hash ^= bytes[i];
+        hash *= FNV_PRIME;
+    }
+
+    return hash;
+}
+
+// Prints what was run and hashes of the final state.
+void print_stats(unsigned long frames, unsigned long cycles,
+                 unsigned long executed, unsigned long skipped, double seconds)
+{
+    chip8_sync_timers(&chip8);
+
+    uint64_t ram_hash = hash_bytes(FNV_OFFSET_BASIS, chip8.RAM, MAX_RAM);
+
+    uint64_t reg_hash = hash_bytes(FNV_OFFSET_BASIS, chip8.V, NUM_REGISTERS);
+    reg_hash = hash_bytes(reg_hash, &chip8.PC, sizeof(chip8.PC));
+    reg_hash = hash_bytes(reg_hash, &chip8.SP, sizeof(chip8.SP));
+    reg_hash = hash_bytes(reg_hash, &chip8.I, sizeof(chip8.I));
+    reg_hash = hash_bytes(reg_hash, &chip8.DT, sizeof(chip8.DT));
+    reg_hash = hash_bytes(reg_hash, &chip8.ST, sizeof(chip8.ST));
+
+    // Hashed at display resolution, whether or not the image is native lores.
+    uint64_t display_hash = FNV_OFFSET_BASIS;
+    CHIP8BP planes[] = {BP1, BP2};
+    for (int p = 0; p < 2; p++)
+    {
+        for (int y = 0; y < DISPLAY_HEIGHT; y++)
+        {
+            uint64_t row[DISPLAY_ROW_WORDS];
+            chip8_get_display_row(&chip8, planes[p], y, row);
+            display_hash = hash_bytes(display_hash, row, sizeof(row));
+        }
+    }
+
+    const char *state = "running";
+    if (chip8.exit)
+    {
+        state = "exited";
+    }
+    else if (chip8.halted)
+    {
+        state = "halted";
+    }
+    else if (chip8_is_waiting(&chip8))
+    {
+        state = "waiting for key";
+    }
+
+    printf("frames:       %lu\n", frames);
+    printf("cycles:       %lu\n", cycles);
+    printf("instructions: %lu\n", executed);
+    printf("skipped:      %lu (idle loops)\n", skipped);
+    printf("time:         %.3f s", seconds);
+    if (seconds > 0)
+    {
+        printf(" (%.1f M instructions/s)", executed / seconds / 1e6);
+    }
+    printf("\n");
+    printf("state:        %s\n", state);
+    printf("PC: %04X  I: %04X  SP: %04X  DT: %02X  ST: %02X\n", chip8.PC,
+           chip8.I, chip8.SP, chip8.DT, chip8.ST);
+    printf("RAM hash:     %016llx\n", (unsigned long long)ram_hash);
+    printf("reg hash:     %016llx\n", (unsigned long long)reg_hash);
+    printf("display hash: %016llx\n", (unsigned long long)display_hash);
+}
+
+int main(int argc, char **argv)
+{
+    if (!handle_args(argc, argv) || !init_emulator())
+    {
+        return 1;
+    }
+
+    KEY_EVENT event;
+    bool have_event = read_key_event(&event);
+
+    unsigned long frames = 0;
+    unsigned long cycles = 0;
+    unsigned long executed = 0;
+    unsigned long skipped = chip8.skipped_cycles;
+    clock_t start = clock();
+
+    /* Emulated time advances one frame at a time through the same code as the
+    libretro core, no matter how fast the host is. */
+    while ((!max_frames || frames < max_frames) &&
+           (!max_instructions || cycles < max_instructions) &&
+           !chip8.exit && !chip8.halted)
+    {
+        while (have_event && event.frame <= frames)
+        {
+            handle_key_event(&event);
+            have_event = read_key_event(&event);
+        }
+
+        unsigned long frame_cycles = chip8_frame_cycles(&chip8);
+        if (max_instructions && frame_cycles > max_instructions - cycles)
+        {
+            // A frame cut short doesn't get to advance the timers.
+            frame_cycles = max_instructions - cycles;
+            executed += chip8_run(&chip8, (int)frame_cycles, false);
+        }
+        else
+        {
+            executed += chip8_run_frame(&chip8, frame_cycles);
+        }
+
+        cycles += frame_cycles;
+
+        frames++;
+    }
+
+    double seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+    // Idle loop iterations that were skipped don't count as executed.
+    skipped = chip8.skipped_cycles - skipped;
+    print_stats(frames, cycles, executed - skipped, skipped, seconds);
+
+    if (input_file)
+    {
+        fclose(input_file);
+    }
+
+    chip8_deinit(&chip8);
+
+    return 0;
+}
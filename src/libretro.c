@@ -6,6 +6,11 @@
 #include "libretro.h"
 #include "chip8.h"
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define USE_SSE2
+#endif
+
 #define VALID_EXTENSIONS "ch8|sc8|xo8|hc8"
 
 #ifdef USE_RGB565
@@ -31,12 +36,13 @@ static retro_audio_sample_t audio_cb;
 static retro_audio_sample_batch_t audio_batch_cb;
 
 static CHIP8 chip8;
-static unsigned long cpu_debt = 0;
 #define AUDIO_RESAMPLE_RATE 44100
 static unsigned int audio_counter_chip8 = 0;
 static unsigned int audio_counter_resample = 0;
 static unsigned int audio_freq_chip8 = 0;
 static int snd_buf_pntr = 0;
+static bool can_dupe = false;
+static bool cpu_freq_auto = false;
 static uint8_t sram[NUM_USER_FLAGS];
 
 struct theme {
@@ -89,10 +95,15 @@ static const struct theme color_themes[] = {
     {vRGB(0,0,0), vRGB(0,0xFF,0), vRGB(0xFF,0,0), vRGB(0xFF,0xFF,0), "CGA 0"},
     {vRGB(0,0,0), vRGB(0xFF,0,0xFF), vRGB(0,0xFF,0xFF), vRGB(0xFF,0xFF,0xFF), "CGA 1"}
 };
-static pixel_t bg_color = BG_COLOR_DEFAULT;
-static pixel_t p1_color = P1_COLOR_DEFAULT;
-static pixel_t p2_color = P2_COLOR_DEFAULT;
-static pixel_t overlap_color = OVERLAP_COLOR_DEFAULT;
+
+// Colors indexed by a pixel's bit in plane 1 plus twice its bit in plane 2.
+static pixel_t palette[4] = {
+    BG_COLOR_DEFAULT, P1_COLOR_DEFAULT, P2_COLOR_DEFAULT, OVERLAP_COLOR_DEFAULT
+};
+#ifdef USE_SSE2
+static __m128i palette_vec[4];
+#endif
+static bool palette_built = false;
 
 static void fallback_log(enum retro_log_level level,
 			 const char *fmt, ...) {
@@ -148,9 +159,16 @@ static struct retro_variable variables[] =
     "jaxe_quirk_9_disable_undefined_VF_after_logical_OR_AND_XOR",
     "Disable undefined VF after logical OR, AND, XOR; enabled|disabled",
     },
+    /* "auto" calibrates to the host, which stalls the core for
+       CALIBRATION_TIME_DEFAULT whenever a ROM is loaded, auto is picked or
+       IPF is turned off while auto is selected. */
     {
 	"jaxe_cpu_requency",
-	"CPU frequency; 1000|1500|2000|3000|5000|10000|25000|50000|100000|800|750|600|500|400|300",
+	"CPU frequency; 1000|1500|2000|3000|5000|10000|25000|50000|100000|800|750|600|500|400|300|auto",
+    },
+    {
+	"jaxe_ipf",
+	"Instructions per frame (overrides CPU frequency); off|7|10|15|20|30|100|200|500|1000",
     },
     {
 	"jaxe_theme",
@@ -242,10 +260,26 @@ static void load_theme(void)
 	}
     }
 
-    bg_color = color_themes[theme_number].bg;
-    p1_color = color_themes[theme_number].p1;
-    p2_color = color_themes[theme_number].p2;
-    overlap_color = color_themes[theme_number].overlap;
+    const struct theme *theme = &color_themes[theme_number];
+    if (palette_built && palette[0] == theme->bg && palette[1] == theme->p1 &&
+	palette[2] == theme->p2 && palette[3] == theme->overlap)
+	return;
+
+    palette[0] = theme->bg;
+    palette[1] = theme->p1;
+    palette[2] = theme->p2;
+    palette[3] = theme->overlap;
+#ifdef USE_SSE2
+    for (int i = 0; i < 4; i++) {
+#ifdef USE_RGB565
+	palette_vec[i] = _mm_set1_epi16((short)palette[i]);
+#else
+	palette_vec[i] = _mm_set1_epi32((int)palette[i]);
+#endif
+    }
+#endif
+    palette_built = true;
+    chip8_invalidate_display(&chip8);
 }
 
 static unsigned long get_cpu_freq_var(unsigned long def)
@@ -261,6 +295,43 @@ static unsigned long get_cpu_freq_var(unsigned long def)
     return cpu_freq;
 }
 
+static bool get_cpu_freq_auto_var(void)
+{
+    struct retro_variable var;
+    var.key = "jaxe_cpu_requency";
+    var.value = NULL;
+    return environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE, &var) && var.value &&
+	strcmp(var.value, "auto") == 0;
+}
+
+/* Switches to the fastest CPU frequency that leaves headroom in each frame on
+   this host, and logs the measurement. */
+static void calibrate_speed(void)
+{
+    CHIP8_CALIBRATION cal;
+    if (!chip8_calibrate(&chip8, CALIBRATION_TIME_DEFAULT,
+			 CALIBRATION_HEADROOM_DEFAULT, &cal)) {
+	log_cb(RETRO_LOG_WARN, "Unable to calibrate the CPU frequency.\n");
+	return;
+    }
+
+    log_cb(RETRO_LOG_INFO, "Calibrated: %.1f M instructions/s, %lu Hz takes %.3f ms per frame\n",
+	   cal.instructions_per_sec / 1e6, cal.cpu_freq, cal.frame_time * 1e3);
+
+    chip8_set_cpu_freq(&chip8, cal.cpu_freq);
+}
+
+// Returns 0 (off) unless IPF mode is selected.
+static unsigned long get_ipf_var(void)
+{
+    struct retro_variable var;
+    var.key = "jaxe_ipf";
+    var.value = NULL;
+    if (!environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE, &var) || !var.value)
+	return 0;
+    return strtoul(var.value, 0, 0);
+}
+
 static void chip8_init_with_vars(void)
 {
     bool quirks[NUM_QUIRKS] = {1, 1, 1, 1, 1, 1, 1, 1, 1, 1};
@@ -283,37 +354,84 @@ static void chip8_init_with_vars(void)
 
     chip8_init(&chip8, cpu_freq, timer_freq, refresh_freq, pc_start_addr,
 	       quirks);
+    chip8_set_ipf(&chip8, get_ipf_var());
+}
+
+#ifdef USE_SSE2
+// Picks a where mask is set and b elsewhere.
+static __m128i select_vec(__m128i mask, __m128i a, __m128i b)
+{
+    return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+}
+#endif
+
+/* Converts 16 pixels to colors, given by the lowest 16 bits of plane1 and
+plane2 (leftmost pixel first). */
+static void convert_pixels(pixel_t *out, unsigned plane1, unsigned plane2)
+{
+#ifdef USE_SSE2
+    // Every lane tests its own bit of the pixels in the vector.
+#ifdef USE_RGB565
+    const int per_vec = 8;
+    const __m128i bits = _mm_setr_epi16(0x80, 0x40, 0x20, 0x10, 0x8, 0x4, 0x2, 0x1);
+#define SPREAD_BITS(v) _mm_set1_epi16((short)(v))
+#define BITS_SET(v) _mm_cmpeq_epi16(_mm_and_si128((v), bits), bits)
+#else
+    const int per_vec = 4;
+    const __m128i bits = _mm_setr_epi32(0x8, 0x4, 0x2, 0x1);
+#define SPREAD_BITS(v) _mm_set1_epi32((int)(v))
+#define BITS_SET(v) _mm_cmpeq_epi32(_mm_and_si128((v), bits), bits)
+#endif
+    for (int i = 0; i < 16; i += per_vec)
+    {
+	int shift = 16 - per_vec - i;
+	unsigned group = (1u << per_vec) - 1;
+	__m128i on1 = BITS_SET(SPREAD_BITS((plane1 >> shift) & group));
+	__m128i on2 = BITS_SET(SPREAD_BITS((plane2 >> shift) & group));
+
+	__m128i plane2_off = select_vec(on1, palette_vec[1], palette_vec[0]);
+	__m128i plane2_on = select_vec(on1, palette_vec[3], palette_vec[2]);
+	_mm_storeu_si128((__m128i *)(out + i),
+			 select_vec(on2, plane2_on, plane2_off));
+    }
+#undef SPREAD_BITS
+#undef BITS_SET
+#else
+    for (int i = 0; i < 16; i++)
+    {
+	int shift = 15 - i;
+	out[i] = palette[((plane1 >> shift) & 1) | (((plane2 >> shift) & 1) << 1)];
+    }
+#endif
 }
 
 // Makes the physical screen match the emulator display.
 void draw_display(void)
 {
+    // The frame keeps its contents, so only the changed rows are repainted.
+    uint64_t dirty = chip8_get_dirty_rows(&chip8);
+
     for (int y = 0; y < DISPLAY_HEIGHT; y++)
     {
-	for (int x = 0; x < DISPLAY_WIDTH; x++)
+	if (!(dirty & (1ULL << y)))
 	{
-	    pixel_t color;
-
-	    if (!chip8.display[y][x] && !chip8.display2[y][x])
-	    {
-		color = bg_color;
-	    }
-	    else if (chip8.display[y][x] && !chip8.display2[y][x])
-	    {
-		color = p1_color;
-	    }
-	    else if (!chip8.display[y][x] && chip8.display2[y][x])
-	    {
-		color = p2_color;
-	    }
-	    else
-	    {
-		color = overlap_color;
-	    }
-
-	    frame[x + y * DISPLAY_WIDTH] = color;
+	    continue;
+	}
+
+	uint64_t row1[DISPLAY_ROW_WORDS], row2[DISPLAY_ROW_WORDS];
+	chip8_get_display_row(&chip8, BP1, y, row1);
+	chip8_get_display_row(&chip8, BP2, y, row2);
+
+	for (int x = 0; x < DISPLAY_WIDTH; x += 16)
+	{
+	    int shift = 48 - (x % 64);
+	    convert_pixels(&frame[x + y * DISPLAY_WIDTH],
+			   (row1[x / 64] >> shift) & 0xFFFF,
+			   (row2[x / 64] >> shift) & 0xFFFF);
 	}
     }
+
+    chip8_clear_dirty_rows(&chip8);
 }
 
 void retro_set_video_refresh(retro_video_refresh_t fn) { video_cb = fn; }
@@ -331,7 +449,6 @@ static const void *rom_data = NULL;
 static size_t rom_size = 0;
 
 static void load_rom(void) {
-    cpu_debt = 0;
     audio_counter_chip8 = 0;
     audio_counter_resample = 0;
     audio_freq_chip8 = 0;
@@ -341,6 +458,11 @@ static void load_rom(void) {
     chip8_load_font(&chip8);
 
     chip8_load_rom_buffer(&chip8, rom_data, rom_size);
+
+    // Calibration runs the loaded ROM. IPF overrides any CPU frequency.
+    cpu_freq_auto = get_cpu_freq_auto_var();
+    if (cpu_freq_auto && !chip8.ipf)
+	calibrate_speed();
 }
 
 bool retro_load_game(const struct retro_game_info *info)
@@ -376,6 +498,10 @@ bool retro_load_game(const struct retro_game_info *info)
 	rom_data = (const uint8_t*)rom_buf;
     }
 
+    // Frames without any display change are then not sent again.
+    if (!environ_cb(RETRO_ENVIRONMENT_GET_CAN_DUPE, &can_dupe))
+	can_dupe = false;
+
     load_rom();
 
     return true;
@@ -433,6 +559,31 @@ static void audio_sample(int16_t sample) {
     }
 }
 
+static void output_audio(uint64_t elapsed)
+{
+    if (!chip8.beep) {
+	audio_freq_chip8 = 0;
+	audio_counter_chip8 = 0;
+	snd_buf_pntr = 0;
+	audio_counter_resample += elapsed;
+	audio_sample(0);
+    } else {
+	uint64_t cycle_audio_step;
+	if (!audio_freq_chip8) {
+	    audio_freq_chip8 = chip8_get_sound_freq(&chip8);
+	    snd_buf_pntr = 0;
+	}
+	cycle_audio_step = ONE_SEC / audio_freq_chip8;
+	audio_counter_chip8 += elapsed;
+	while (audio_counter_chip8 > cycle_audio_step) {
+	    audio_counter_chip8 -= cycle_audio_step;
+	    int16_t sample = get_audio_sample();
+	    audio_counter_resample += cycle_audio_step;
+	    audio_sample(sample);
+	}
+    }
+}
+
 void retro_run(void)
 {
     if (chip8.exit) {
@@ -446,6 +597,17 @@ void retro_run(void)
 	unsigned long cpu_freq = get_cpu_freq_var(chip8.cpu_freq);
 	if (cpu_freq != chip8.cpu_freq)
 	    chip8_set_cpu_freq(&chip8, cpu_freq);
+	unsigned long ipf = get_ipf_var();
+	bool ipf_turned_off = chip8.ipf && !ipf;
+	if (ipf != chip8.ipf)
+	    chip8_set_ipf(&chip8, ipf);
+
+	/* IPF overrides auto like any CPU frequency. Auto calibrates when it is
+	   picked or IPF is turned off, and keeps its speed otherwise. */
+	bool cpu_auto = get_cpu_freq_auto_var();
+	if (cpu_auto && !ipf && (!cpu_freq_auto || ipf_turned_off))
+	    calibrate_speed();
+	cpu_freq_auto = cpu_auto;
     }
 
     input_poll_cb();
@@ -456,51 +618,15 @@ void retro_run(void)
 	else
 	    chip8.keypad[i] = chip8.keypad[i] == KEY_DOWN ? KEY_RELEASED : KEY_UP;
 
-    uint64_t cycle_step = ONE_SEC / chip8.cpu_freq;
-
-    for (unsigned i = 0; i < (chip8.cpu_freq + cpu_debt) / chip8.refresh_freq && !chip8.exit; i++) {
-	chip8.total_cycle_time = cycle_step;
-	chip8_execute(&chip8);
-	if (chip8.timer_freq != chip8.refresh_freq)
-	    chip8_handle_timers(&chip8);
+    chip8_run_frame(&chip8, chip8_frame_cycles(&chip8));
+    output_audio(ONE_SEC / chip8.refresh_freq);
 
-	if (!chip8.beep) {
-	    audio_freq_chip8 = 0;
-	    audio_counter_chip8 = 0;
-	    snd_buf_pntr = 0;
-	    audio_counter_resample += cycle_step;
-	    audio_sample(0);
-	} else {
-	    uint64_t cycle_audio_step;
-	    if (!audio_freq_chip8) {
-		audio_freq_chip8 = chip8_get_sound_freq(&chip8);
-		snd_buf_pntr = 0;
-	    }
-	    cycle_audio_step = ONE_SEC / audio_freq_chip8;
-	    audio_counter_chip8 += cycle_step;
-	    while (audio_counter_chip8 > cycle_audio_step) {
-		audio_counter_chip8 -= cycle_audio_step;
-		int16_t sample = get_audio_sample();
-		audio_counter_resample += cycle_audio_step;
-		audio_sample(sample);
-	    }
-	}
-    }
-
-    if (chip8.timer_freq == chip8.refresh_freq) {
-    	if (chip8.DT > 0)
-    	    chip8.DT--;
-
-    	if (chip8.ST > 0) 
-        {
-    	    chip8.ST--;
-            chip8.beep =  chip8.ST > 0 ? true : false;
-        }
+    // Output video, or have the frontend show the last frame again.
+    if (can_dupe && !chip8_get_dirty_rows(&chip8)) {
+	video_cb(NULL, DISPLAY_WIDTH, DISPLAY_HEIGHT, sizeof(pixel_t) * DISPLAY_WIDTH);
+	return;
     }
 
-    cpu_debt = (chip8.cpu_freq + cpu_debt) % chip8.refresh_freq;
-
-    // Output video
     draw_display();
     video_cb(frame, DISPLAY_WIDTH, DISPLAY_HEIGHT, sizeof(pixel_t) * DISPLAY_WIDTH);
 }
@@ -544,7 +670,10 @@ void retro_get_system_av_info(struct retro_system_av_info *info)
 }
 
 
-void retro_deinit(void) {  }
+void retro_deinit(void)
+{
+    chip8_deinit(&chip8);
+}
 
 void retro_reset(void)
 {
@@ -554,7 +683,6 @@ void retro_reset(void)
 struct serialized_state
 {
     CHIP8 chip8;
-    unsigned long cpu_debt;
     unsigned int audio_counter_chip8;
     unsigned int audio_counter_resample;
     unsigned int audio_freq_chip8;
@@ -573,8 +701,8 @@ bool retro_serialize(void *data, size_t size)
 	return false;
 
     struct serialized_state *st = (struct serialized_state *) data;
+    chip8_sync_timers(&chip8);
     memcpy(&st->chip8, &chip8, sizeof(st->chip8));
-    st->cpu_debt = cpu_debt;
     st->audio_counter_chip8 = audio_counter_chip8;
     st->audio_counter_resample = audio_counter_resample;
     st->audio_freq_chip8 = audio_freq_chip8;
@@ -589,8 +717,12 @@ bool retro_unserialize(const void *data, size_t size)
 	return false;
 
     const struct serialized_state *st = (struct serialized_state *) data;
+    // The state holds a stale pointer, so keep our own instruction cache.
+    CHIP8_ICACHE *icache = chip8.icache;
     memcpy(&chip8, &st->chip8, sizeof(chip8));
-    cpu_debt = st->cpu_debt;
+    chip8.icache = icache;
+    chip8_invalidate_code(&chip8, 0, MAX_RAM);
+    chip8_invalidate_display(&chip8);
     audio_counter_chip8 = st->audio_counter_chip8;
     audio_counter_resample = st->audio_counter_resample;
     audio_freq_chip8 = st->audio_freq_chip8;
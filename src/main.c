@@ -19,6 +19,11 @@
 #define DBG_FONT_FILE "../fonts/dbgfont.ttf"
 #define DBG_FONT_SIZE 12
 
+// Scheduling (in nanoseconds unless noted)
+#define BATCH_TIME_MIN 1000000
+#define BATCH_TIME_MAX 100000000
+#define UNCAPPED_BATCH_SIZE 1000 // Instructions
+
 #define DISPLAY_SCALE_DEFAULT 5
 #define DISPLAY_SCALE_MAX 20
 #define BG_COLOR_DEFAULT 0x000000
@@ -37,6 +42,8 @@ uint16_t pc_start_addr = PC_START_ADDR_DEFAULT;
 unsigned long cpu_freq = CPU_FREQ_DEFAULT;
 unsigned long timer_freq = TIMER_FREQ_DEFAULT;
 unsigned long refresh_freq = REFRESH_FREQ_DEFAULT;
+unsigned long ipf = 0;
+bool calibrate = false;
 bool play_sound = false;
 bool quirks[NUM_QUIRKS] = {1, 1, 1, 1, 1, 1, 1, 1, 1, 1};
 bool load_dmp = false;
@@ -62,7 +69,10 @@ long color_themes[] = {
 };
 int color_theme_pntr = 0;
 SDL_Window *window = NULL;
-SDL_Surface *surface = NULL;
+SDL_Renderer *renderer = NULL;
+SDL_Texture *display_texture = NULL;
+SDL_Texture *dbg_texture = NULL;
+Uint32 display_pixels[DISPLAY_WIDTH * DISPLAY_HEIGHT];
 int display_scale = DISPLAY_SCALE_DEFAULT;
 long bg_color = BG_COLOR_DEFAULT;
 long p1_color = P1_COLOR_DEFAULT;
@@ -104,6 +114,9 @@ void dbg_stack_pop()
     }
 
     chip8 = dbg_stack[dbg_stack_pntr];
+    chip8_invalidate_code(&chip8, 0, MAX_RAM);
+    chip8_invalidate_display(&chip8);
+    chip8_reset_clock(&chip8);
     dbg_step = true;
     dbg_step_back = true;
 }
@@ -121,6 +134,7 @@ void cycle_color_theme()
     p1_color = color_themes[color_theme_pntr + 1];
     p2_color = color_themes[color_theme_pntr + 2];
     overlap_color = color_themes[color_theme_pntr + 3];
+    chip8_invalidate_display(&chip8);
 }
 
 // Frees all resources and exits.
@@ -132,10 +146,22 @@ void clean_exit(int status)
         dbg_font = NULL;
     }
 
-    if (surface)
+    if (dbg_texture)
+    {
+        SDL_DestroyTexture(dbg_texture);
+        dbg_texture = NULL;
+    }
+
+    if (display_texture)
     {
-        SDL_FreeSurface(surface);
-        surface = NULL;
+        SDL_DestroyTexture(display_texture);
+        display_texture = NULL;
+    }
+
+    if (renderer)
+    {
+        SDL_DestroyRenderer(renderer);
+        renderer = NULL;
     }
 
     if (window)
@@ -147,6 +173,8 @@ void clean_exit(int status)
     SDL_CloseAudio();
     SDL_Quit();
 
+    chip8_deinit(&chip8);
+
     exit(status);
 }
 
@@ -277,7 +305,7 @@ bool handle_args(int argc, char **argv)
 
 #ifdef ALLOW_GETOPTS
         int opt;
-        while ((opt = getopt(argc, argv, "012345678xldms:p:c:t:r:f:b:n:k:")) != -1)
+        while ((opt = getopt(argc, argv, "012345678xldmas:p:c:t:r:i:f:b:n:k:")) != -1)
         {
             switch (opt)
             {
@@ -359,6 +387,16 @@ bool handle_args(int argc, char **argv)
                 refresh_freq = atoi(optarg);
                 break;
 
+            // Pick the CPU frequency (or IPF) the host can sustain
+            case 'a':
+                calibrate = true;
+                break;
+
+            // Set the number of instructions per frame (IPF mode)
+            case 'i':
+                ipf = strtoul(optarg, NULL, 10);
+                break;
+
             // Set background color
             case 'b':
                 color_themes[0] = strtol(optarg, NULL, 16);
@@ -390,6 +428,32 @@ bool handle_args(int argc, char **argv)
     return true;
 }
 
+/* Measures how fast the host runs the ROM and switches to the fastest speed
+that leaves headroom in each frame. */
+void calibrate_speed()
+{
+    CHIP8_CALIBRATION cal;
+    if (!chip8_calibrate(&chip8, CALIBRATION_TIME_DEFAULT,
+                         CALIBRATION_HEADROOM_DEFAULT, &cal))
+    {
+        fprintf(stderr, "Unable to calibrate, keeping the CPU frequency.\n");
+        return;
+    }
+
+    printf("Calibrated: %.1f M instructions/s, %lu Hz (%lu IPF) takes "
+           "%.3f ms per frame\n", cal.instructions_per_sec / 1e6, cal.cpu_freq,
+           cal.ipf, cal.frame_time * 1e3);
+
+    if (chip8.ipf)
+    {
+        chip8_set_ipf(&chip8, cal.ipf);
+    }
+    else
+    {
+        chip8_set_cpu_freq(&chip8, cal.cpu_freq);
+    }
+}
+
 // Set up the emulator to begin running.
 bool init_emulator()
 {
@@ -412,6 +476,16 @@ bool init_emulator()
         return false;
     }
 
+    if (ipf)
+    {
+        chip8_set_ipf(&chip8, ipf);
+    }
+
+    if (calibrate)
+    {
+        calibrate_speed();
+    }
+
     // Initialize the dbg stack with instances of the initial emulator state.
     for (int i = 0; i < DBG_STACK_MAX; i++)
     {
@@ -471,52 +545,157 @@ SDL_Window *create_window()
     return new_window;
 }
 
-// Sets a pixel of the SDL surface to a certain color.
-void set_pixel(int x, int y, long color)
+/* Create the renderer along with the textures the display and debug panel
+are drawn to. The display texture is only 128x64 and gets scaled by the
+renderer, which may be the software one. */
+bool create_renderer()
 {
-    Uint32 *pixels = (Uint32 *)surface->pixels;
-    pixels[(y * surface->w) + x] = color;
+    renderer = SDL_CreateRenderer(window, -1, 0);
+    if (!renderer)
+    {
+        renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_SOFTWARE);
+    }
+
+    if (!renderer)
+    {
+        fprintf(stderr, "Could not create SDL renderer: %s\n", SDL_GetError());
+        return false;
+    }
+
+    // Keep the pixels sharp when scaling.
+    SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, "nearest");
+
+    display_texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGB888,
+                                        SDL_TEXTUREACCESS_STREAMING,
+                                        DISPLAY_WIDTH, DISPLAY_HEIGHT);
+    if (!display_texture)
+    {
+        fprintf(stderr, "Could not create SDL texture: %s\n", SDL_GetError());
+        return false;
+    }
+
+    if (debug_mode)
+    {
+        dbg_texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGB888,
+                                        SDL_TEXTUREACCESS_STREAMING,
+                                        DBG_PANEL_WIDTH, DBG_PANEL_HEIGHT);
+        if (!dbg_texture)
+        {
+            fprintf(stderr, "Could not create SDL texture: %s\n",
+                    SDL_GetError());
+            return false;
+        }
+    }
+
+    return true;
 }
 
-// Makes the physical screen match the emulator display.
-void draw_display()
+/* Updates the display texture with the rows of the emulator display that
+changed. Returns false if none did. */
+bool draw_display()
 {
+    uint64_t dirty = chip8_get_dirty_rows(&chip8);
+    if (!dirty)
+    {
+        return false;
+    }
+
     for (int y = 0; y < DISPLAY_HEIGHT; y++)
     {
+        if (!(dirty & (1ULL << y)))
+        {
+            continue;
+        }
+
+        uint64_t row1[DISPLAY_ROW_WORDS], row2[DISPLAY_ROW_WORDS];
+        chip8_get_display_row(&chip8, BP1, y, row1);
+        chip8_get_display_row(&chip8, BP2, y, row2);
+
         for (int x = 0; x < DISPLAY_WIDTH; x++)
         {
-            for (int i = 0; i < display_scale; i++)
+            bool p1 = (row1[x / 64] & CHIP8_PIXEL_BIT(x)) != 0;
+            bool p2 = (row2[x / 64] & CHIP8_PIXEL_BIT(x)) != 0;
+            long color;
+
+            if (!p1 && !p2)
             {
-                for (int j = 0; j < display_scale; j++)
-                {
-                    int sdl_x = (x * display_scale) + j;
-                    int sdl_y = (y * display_scale) + i;
-                    long color;
-
-                    if (!chip8.display[y][x] && !chip8.display2[y][x])
-                    {
-                        color = bg_color;
-                    }
-                    else if (chip8.display[y][x] && !chip8.display2[y][x])
-                    {
-                        color = p1_color;
-                    }
-                    else if (!chip8.display[y][x] && chip8.display2[y][x])
-                    {
-                        color = p2_color;
-                    }
-                    else if (chip8.display[y][x] && chip8.display2[y][x])
-                    {
-                        color = overlap_color;
-                    }
-
-                    set_pixel(sdl_x, sdl_y, color);
-                }
+                color = bg_color;
             }
+            else if (p1 && !p2)
+            {
+                color = p1_color;
+            }
+            else if (!p1 && p2)
+            {
+                color = p2_color;
+            }
+            else
+            {
+                color = overlap_color;
+            }
+
+            display_pixels[(y * DISPLAY_WIDTH) + x] = color;
         }
     }
 
-    SDL_UpdateWindowSurface(window);
+    // Upload every run of changed rows at once.
+    for (int y = 0; y < DISPLAY_HEIGHT; y++)
+    {
+        if (!(dirty & (1ULL << y)))
+        {
+            continue;
+        }
+
+        SDL_Rect rows;
+        rows.x = 0;
+        rows.y = y;
+        rows.w = DISPLAY_WIDTH;
+        rows.h = 0;
+
+        while (y < DISPLAY_HEIGHT && (dirty & (1ULL << y)))
+        {
+            rows.h++;
+            y++;
+        }
+
+        SDL_UpdateTexture(display_texture, &rows,
+                          &display_pixels[rows.y * DISPLAY_WIDTH],
+                          DISPLAY_WIDTH * sizeof(Uint32));
+    }
+
+    chip8_clear_dirty_rows(&chip8);
+
+    return true;
+}
+
+/* Draws the display texture scaled to the window, next to the debug panel in
+debug mode. */
+void present()
+{
+    SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
+    SDL_RenderClear(renderer);
+
+    SDL_Rect display_rect;
+    display_rect.x = 0;
+    display_rect.y = 0;
+    display_rect.w = DISPLAY_WIDTH * display_scale;
+    display_rect.h = DISPLAY_HEIGHT * display_scale;
+    SDL_RenderCopy(renderer, display_texture, NULL, &display_rect);
+
+    if (debug_mode)
+    {
+        SDL_Rect src_rect;
+        src_rect.x = 0;
+        src_rect.y = 0;
+        src_rect.w = DBG_PANEL_WIDTH - 1;
+        src_rect.h = DBG_PANEL_HEIGHT;
+
+        SDL_Rect dest_rect = src_rect;
+        dest_rect.x = (DISPLAY_WIDTH * display_scale) + 1;
+        SDL_RenderCopy(renderer, dbg_texture, &src_rect, &dest_rect);
+    }
+
+    SDL_RenderPresent(renderer);
 }
 
 /* Display the debug panel.
@@ -530,12 +709,6 @@ void draw_debug()
                                                   32, 0, 0, 0, 0);
     SDL_FillRect(dbg_panel, NULL, SDL_MapRGB(dbg_panel->format, 200, 200, 200));
 
-    SDL_Rect dest_rect;
-    dest_rect.x = (DISPLAY_WIDTH * display_scale) + 1;
-    dest_rect.y = 0;
-    dest_rect.w = DBG_PANEL_WIDTH - 1;
-    dest_rect.h = DBG_PANEL_HEIGHT;
-
     // Now create text with useful information.
     SDL_Surface *txt = NULL;
     SDL_Color font_color;
@@ -642,10 +815,9 @@ void draw_debug()
     SDL_BlitSurface(txt, NULL, dbg_panel, &font_dest_rect);
     SDL_FreeSurface(txt);
 
-    // Finally blit debug panel onto window.
-    SDL_BlitSurface(dbg_panel, NULL, surface, &dest_rect);
+    // Finally upload the debug panel to its texture.
+    SDL_UpdateTexture(dbg_texture, NULL, dbg_panel->pixels, dbg_panel->pitch);
     SDL_FreeSurface(dbg_panel);
-    SDL_UpdateWindowSurface(window);
 }
 
 // Converts an SDL key code to the respective key on the emulator keypad.
@@ -725,14 +897,161 @@ void handle_sound()
 // Handles drawing the display.
 void handle_display()
 {
+    bool changed = false;
+
     if (chip8.display_updated)
     {
-        draw_display();
+        changed = draw_display();
     }
 
     if (debug_mode)
     {
         draw_debug();
+        changed = true;
+    }
+
+    if (changed)
+    {
+        present();
+    }
+}
+
+/* Runs the instructions that became due since the last batch, then advances
+the timers and display refresh by the same time. */
+void run_batch()
+{
+    chip8_update_elapsed_time(&chip8);
+
+    // Don't try to catch up after the host stalled.
+    if (chip8.total_cycle_time > BATCH_TIME_MAX)
+    {
+        chip8.total_cycle_time = BATCH_TIME_MAX;
+    }
+
+    // In IPF mode whole frames run at the refresh rate, as in the libretro core.
+    if (chip8.ipf)
+    {
+        chip8.display_updated = false;
+        chip8.refresh_cum += chip8.total_cycle_time;
+        if (!chip8.refresh_freq || chip8.refresh_cum >= chip8.refresh_max_cum)
+        {
+            chip8.refresh_cum = chip8.refresh_freq ?
+                                chip8.refresh_cum % chip8.refresh_max_cum : 0;
+            chip8_run_frame(&chip8, chip8_frame_cycles(&chip8));
+            chip8.display_updated = true;
+
+            if (debug_mode)
+            {
+                dbg_stack_push();
+            }
+        }
+
+        return;
+    }
+
+    int due = UNCAPPED_BATCH_SIZE;
+    if (chip8.cpu_freq)
+    {
+        // Keep the leftover time so no fraction of an instruction is lost.
+        int64_t period = (chip8.cpu_max_cum > 0) ? chip8.cpu_max_cum : 1;
+        chip8.cpu_cum += chip8.total_cycle_time;
+        due = chip8.cpu_cum / period;
+        chip8.cpu_cum %= period;
+    }
+
+    if (debug_mode)
+    {
+        // Every instruction gets its own entry in the debug stack.
+        while (due > 0 && chip8_run(&chip8, 1, false))
+        {
+            dbg_stack_push();
+            due--;
+        }
+    }
+    else
+    {
+        chip8_run(&chip8, due, false);
+    }
+
+    chip8_handle_timers(&chip8);
+}
+
+// Runs a single instruction for the debugger, as if it had been due.
+void run_step()
+{
+    chip8_update_elapsed_time(&chip8);
+
+    if (chip8_run(&chip8, 1, false))
+    {
+        dbg_stack_push();
+    }
+
+    /* In IPF mode the timers only tick with whole frames. An uncapped CPU has
+    no period of its own, so each step counts as one at the default speed. */
+    if (!chip8.ipf)
+    {
+        chip8.total_cycle_time = chip8.cpu_freq ? chip8.cpu_max_cum
+                                                : ONE_SEC / CPU_FREQ_DEFAULT;
+        chip8_handle_timers(&chip8);
+    }
+}
+
+/* Returns the time until the next instruction batch, timer tick or display
+refresh is due. */
+int64_t time_until_due()
+{
+    if (chip8.ipf)
+    {
+        return chip8.refresh_freq ? chip8.refresh_max_cum - chip8.refresh_cum
+                                  : 0;
+    }
+
+    if (!chip8.timer_freq || !chip8.refresh_freq)
+    {
+        return 0;
+    }
+
+    int64_t timeout = chip8.refresh_max_cum - chip8.refresh_cum;
+
+    if ((chip8.DT > 0 || chip8.ST > 0) &&
+        chip8.timer_max_cum - chip8.timer_cum < timeout)
+    {
+        timeout = chip8.timer_max_cum - chip8.timer_cum;
+    }
+
+    // Nothing runs while paused, halted or waiting for a key.
+    if (!paused && !chip8.halted && !chip8_is_waiting(&chip8))
+    {
+        if (!chip8.cpu_freq)
+        {
+            return 0;
+        }
+
+        /* Wake up for batches of instructions rather than for each of them
+        when the CPU is fast. */
+        int64_t cpu_timeout = chip8.cpu_max_cum - chip8.cpu_cum;
+        if (cpu_timeout < BATCH_TIME_MIN)
+        {
+            cpu_timeout = BATCH_TIME_MIN;
+        }
+
+        if (cpu_timeout < timeout)
+        {
+            timeout = cpu_timeout;
+        }
+    }
+
+    return timeout;
+}
+
+/* Sleeps until something is due or an event arrives. The timeout is rounded
+up to whole milliseconds since a late batch just runs more instructions. */
+void wait_until_due()
+{
+    int64_t timeout = time_until_due();
+    if (timeout > 0)
+    {
+        SDL_WaitEventTimeout(NULL, (timeout + 999999) / 1000000);
     }
 }
 
@@ -750,6 +1069,15 @@ bool handle_input(SDL_Event *e)
             return false;
             break;
 
+        // The window contents may have been lost
+        case SDL_WINDOWEVENT:
+            if (e->window.event == SDL_WINDOWEVENT_EXPOSED)
+            {
+                chip8_invalidate_display(&chip8);
+            }
+
+            break;
+
         case SDL_KEYUP:
             hexkey = SDLK_to_hex(e->key.keysym.sym);
             keyc = e->key.keysym.sym;
@@ -847,31 +1175,39 @@ int main(int argc, char **argv)
         clean_exit(1);
     }
 
-    surface = SDL_GetWindowSurface(window);
-    if (!surface)
+    if (!create_renderer())
     {
-        fprintf(stderr, "Could not create SDL surface: %s\n", SDL_GetError());
         clean_exit(1);
     }
 
+    /* Instead of spinning, sleep until the next instruction batch, timer tick
+    or display refresh is due. */
     SDL_Event e;
     while (!chip8.exit && handle_input(&e))
     {
-        if ((!paused || dbg_step) && !dbg_step_back)
+        if (dbg_step && !dbg_step_back)
         {
-            /* Push the state of the emulator into debug stack if the CPU
-            actually executed an instruction and wasn't sleeping. */
-            if (chip8_cycle(&chip8))
-            {
-                dbg_stack_push();
-            }
+            run_step();
+        }
+        else if (!paused)
+        {
+            run_batch();
+        }
+        else
+        {
+            // Time spent paused is not caught up on afterwards.
+            chip8_update_elapsed_time(&chip8);
         }
 
+        // The sound and the debugger need DT and ST up to date.
+        chip8_sync_timers(&chip8);
         handle_sound();
         handle_display();
 
         dbg_step = false;
         dbg_step_back = false;
+
+        wait_until_due();
     }
 
     clean_exit(0);
@@ -6,6 +6,20 @@
 
 CHIP8 chip8;
 
+// Loads len instructions at the program start address, like chip8_load_instr.
+void load_program(CHIP8 *chip8, const uint16_t *program, size_t len)
+{
+    assert(chip8->pc_start_addr + len * 2 <= MAX_RAM);
+
+    for (size_t i = 0; i < len; i++)
+    {
+        chip8->RAM[chip8->pc_start_addr + (i * 2)] = program[i] >> 8;
+        chip8->RAM[chip8->pc_start_addr + (i * 2) + 1] = program[i] & 0x00FF;
+    }
+
+    chip8_invalidate_code(chip8, chip8->pc_start_addr, len * 2);
+}
+
 void test_0000()
 {
     chip8_load_instr(&chip8, 0x0000);
@@ -13,6 +27,8 @@ void test_0000()
     assert(chip8.PC == PC_START_ADDR_DEFAULT);
     chip8_execute(&chip8);
     assert(chip8.PC == PC_START_ADDR_DEFAULT);
+    assert(chip8.halted);
+    assert(chip8_run(&chip8, 100, false) == 0);
 
     chip8_reset(&chip8);
 }
@@ -21,18 +37,18 @@ void test_00Cn()
 {
     chip8_load_instr(&chip8, 0x00C5);
 
-    chip8.display[6][9] = true;
-    chip8.display[DISPLAY_HEIGHT - 1][9] = true;
+    chip8_set_pixel(&chip8, BP1, 9, 6, true);
+    chip8_set_pixel(&chip8, BP1, 9, DISPLAY_HEIGHT - 1, true);
 
-    assert(chip8.display[6][9]);
-    assert(!chip8.display[11][9]);
-    assert(chip8.display[DISPLAY_HEIGHT - 1][9]);
+    assert(chip8_get_pixel(&chip8, BP1, 9, 6));
+    assert(!chip8_get_pixel(&chip8, BP1, 9, 11));
+    assert(chip8_get_pixel(&chip8, BP1, 9, DISPLAY_HEIGHT - 1));
 
     chip8_execute(&chip8);
 
-    assert(!chip8.display[6][9]);
-    assert(chip8.display[11][9]);
-    assert(!chip8.display[DISPLAY_HEIGHT - 1][9]);
+    assert(!chip8_get_pixel(&chip8, BP1, 9, 6));
+    assert(chip8_get_pixel(&chip8, BP1, 9, 11));
+    assert(!chip8_get_pixel(&chip8, BP1, 9, DISPLAY_HEIGHT - 1));
 
     chip8_reset(&chip8);
 }
@@ -41,18 +57,18 @@ void test_00Dn()
 {
     chip8_load_instr(&chip8, 0x00D5);
 
-    chip8.display[6][9] = true;
-    chip8.display[0][9] = true;
+    chip8_set_pixel(&chip8, BP1, 9, 6, true);
+    chip8_set_pixel(&chip8, BP1, 9, 0, true);
 
-    assert(chip8.display[6][9]);
-    assert(!chip8.display[1][9]);
-    assert(chip8.display[0][9]);
+    assert(chip8_get_pixel(&chip8, BP1, 9, 6));
+    assert(!chip8_get_pixel(&chip8, BP1, 9, 1));
+    assert(chip8_get_pixel(&chip8, BP1, 9, 0));
 
     chip8_execute(&chip8);
 
-    assert(!chip8.display[6][9]);
-    assert(chip8.display[1][9]);
-    assert(!chip8.display[0][9]);
+    assert(!chip8_get_pixel(&chip8, BP1, 9, 6));
+    assert(chip8_get_pixel(&chip8, BP1, 9, 1));
+    assert(!chip8_get_pixel(&chip8, BP1, 9, 0));
 
     chip8_reset(&chip8);
 }
@@ -61,11 +77,11 @@ void test_00E0()
 {
     chip8_load_instr(&chip8, 0x00E0);
 
-    chip8.display[0][0] = true;
-    chip8.display[DISPLAY_HEIGHT / 2][DISPLAY_WIDTH / 2] = true;
-    chip8.display[DISPLAY_HEIGHT - 1][0] = true;
-    chip8.display[0][DISPLAY_WIDTH - 1] = true;
-    chip8.display[DISPLAY_HEIGHT - 1][DISPLAY_WIDTH - 1] = true;
+    chip8_set_pixel(&chip8, BP1, 0, 0, true);
+    chip8_set_pixel(&chip8, BP1, DISPLAY_WIDTH / 2, DISPLAY_HEIGHT / 2, true);
+    chip8_set_pixel(&chip8, BP1, 0, DISPLAY_HEIGHT - 1, true);
+    chip8_set_pixel(&chip8, BP1, DISPLAY_WIDTH - 1, 0, true);
+    chip8_set_pixel(&chip8, BP1, DISPLAY_WIDTH - 1, DISPLAY_HEIGHT - 1, true);
 
     chip8_execute(&chip8);
 
@@ -73,7 +89,7 @@ void test_00E0()
     {
         for (int j = 0; j < DISPLAY_WIDTH; j++)
         {
-            assert(chip8.display[i][j] == false);
+            assert(!chip8_get_pixel(&chip8, BP1, j, i));
         }
     }
 
@@ -100,18 +116,27 @@ void test_00FB()
 {
     chip8_load_instr(&chip8, 0x00FB);
 
-    chip8.display[6][9] = true;
-    chip8.display[6][DISPLAY_WIDTH - 1] = true;
+    chip8_set_pixel(&chip8, BP1, 9, 6, true);
+    chip8_set_pixel(&chip8, BP1, 62, 7, true);
+    chip8_set_pixel(&chip8, BP1, DISPLAY_WIDTH - 1, 6, true);
+    chip8_set_pixel(&chip8, BP2, 9, 6, true);
 
-    assert(chip8.display[6][9]);
-    assert(!chip8.display[6][13]);
-    assert(chip8.display[6][DISPLAY_WIDTH - 1]);
+    assert(chip8_get_pixel(&chip8, BP1, 9, 6));
+    assert(!chip8_get_pixel(&chip8, BP1, 13, 6));
+    assert(chip8_get_pixel(&chip8, BP1, DISPLAY_WIDTH - 1, 6));
 
+    chip8.bitplane = BP1;
     chip8_execute(&chip8);
 
-    assert(!chip8.display[6][9]);
-    assert(chip8.display[6][13]);
-    assert(!chip8.display[6][DISPLAY_WIDTH - 1]);
+    assert(!chip8_get_pixel(&chip8, BP1, 9, 6));
+    assert(chip8_get_pixel(&chip8, BP1, 13, 6));
+    assert(!chip8_get_pixel(&chip8, BP1, 62, 7));
+    assert(chip8_get_pixel(&chip8, BP1, 66, 7));
+    assert(!chip8_get_pixel(&chip8, BP1, DISPLAY_WIDTH - 1, 6));
+
+    // Only the selected plane scrolls.
+    assert(chip8_get_pixel(&chip8, BP2, 9, 6));
+    assert(!chip8_get_pixel(&chip8, BP2, 13, 6));
 
     chip8_reset(&chip8);
 }
@@ -120,18 +145,21 @@ void test_00FC()
 {
     chip8_load_instr(&chip8, 0x00FC);
 
-    chip8.display[6][9] = true;
-    chip8.display[6][0] = true;
+    chip8_set_pixel(&chip8, BP1, 9, 6, true);
+    chip8_set_pixel(&chip8, BP1, 65, 7, true);
+    chip8_set_pixel(&chip8, BP1, 0, 6, true);
 
-    assert(chip8.display[6][9]);
-    assert(!chip8.display[6][5]);
-    assert(chip8.display[6][0]);
+    assert(chip8_get_pixel(&chip8, BP1, 9, 6));
+    assert(!chip8_get_pixel(&chip8, BP1, 5, 6));
+    assert(chip8_get_pixel(&chip8, BP1, 0, 6));
 
     chip8_execute(&chip8);
 
-    assert(!chip8.display[6][9]);
-    assert(chip8.display[6][5]);
-    assert(!chip8.display[6][0]);
+    assert(!chip8_get_pixel(&chip8, BP1, 9, 6));
+    assert(chip8_get_pixel(&chip8, BP1, 5, 6));
+    assert(!chip8_get_pixel(&chip8, BP1, 65, 7));
+    assert(chip8_get_pixel(&chip8, BP1, 61, 7));
+    assert(!chip8_get_pixel(&chip8, BP1, 0, 6));
 
     chip8_reset(&chip8);
 }
@@ -153,6 +181,15 @@ void test_00FE()
     chip8_execute(&chip8);
     assert(!chip8.hires);
 
+    // A hires image that does not fit lores is kept as is.
+    chip8.hires = true;
+    chip8_set_pixel(&chip8, BP1, 5, 5, true);
+    chip8.PC = chip8.pc_start_addr;
+    chip8_execute(&chip8);
+    assert(!chip8.native_lores);
+    assert(chip8_get_pixel(&chip8, BP1, 5, 5));
+    assert(!chip8_get_pixel(&chip8, BP1, 4, 5));
+
     chip8_reset(&chip8);
 }
 
@@ -160,8 +197,19 @@ void test_00FF()
 {
     chip8_load_instr(&chip8, 0x00FF);
 
+    // Lores pixels become 2x2 hires pixels.
+    assert(chip8.native_lores);
+    chip8.I = 0x300;
+    chip8.RAM[0x300] = 0x80;
+    chip8_draw(&chip8, 3, 0, 1, BP1);
+    assert(chip8_get_pixel(&chip8, BP1, 7, 1));
+
     chip8_execute(&chip8);
     assert(chip8.hires);
+    assert(!chip8.native_lores);
+    assert(chip8_get_pixel(&chip8, BP1, 6, 0));
+    assert(chip8_get_pixel(&chip8, BP1, 7, 1));
+    assert(!chip8_get_pixel(&chip8, BP1, 8, 1));
 
     chip8_reset(&chip8);
 }
@@ -172,6 +220,13 @@ void test_1nnn()
 
     chip8_execute(&chip8);
     assert(chip8.PC == 0xFFF);
+    assert(!chip8.halted);
+
+    // Jumping to itself halts.
+    chip8_load_instr(&chip8, 0x1200);
+    chip8.PC = chip8.pc_start_addr;
+    chip8_execute(&chip8);
+    assert(chip8.PC == chip8.pc_start_addr && chip8.halted);
 
     chip8_reset(&chip8);
 }
@@ -460,7 +515,7 @@ void test_8xy6()
     assert(chip8.V[0x0F] == 0x00);
 
     // Turn off S-CHIP quirk for this instruction
-    chip8.quirks[1] = false;
+    chip8_set_quirk(&chip8, 1, false);
 
     // Check least-significant bit 1
     chip8.PC = chip8.pc_start_addr;
@@ -478,8 +533,32 @@ void test_8xy6()
     assert(chip8.V[6] == 0x21);
     assert(chip8.V[0x0F] == 0x00);
 
-    chip8.quirks[1] = true;
+    chip8_set_quirk(&chip8, 1, true);
     chip8_reset(&chip8);
+
+    // Initializing again with the quirk off drops the cached instruction
+    chip8.V[6] = 0x42;
+    chip8.V[9] = 0x69;
+    chip8_execute(&chip8);
+    assert(chip8.V[6] == 0x21);
+
+    bool quirks[NUM_QUIRKS];
+    for (int i = 0; i < NUM_QUIRKS; i++)
+    {
+        quirks[i] = chip8.quirks[i];
+    }
+
+    quirks[1] = false;
+    chip8_init(&chip8, chip8.cpu_freq, chip8.timer_freq, chip8.refresh_freq,
+               chip8.pc_start_addr, quirks);
+    chip8.V[6] = 0x42;
+    chip8.V[9] = 0x69;
+    chip8_execute(&chip8);
+    assert(chip8.V[6] == 0x34);
+
+    quirks[1] = true;
+    chip8_init(&chip8, chip8.cpu_freq, chip8.timer_freq, chip8.refresh_freq,
+               chip8.pc_start_addr, quirks);
 }
 
 void test_8xy7()
@@ -529,7 +608,7 @@ void test_8xyE()
     assert(chip8.V[0x0F] == 0x01);
 
     // Turn off S-CHIP quirk for this instruction
-    chip8.quirks[1] = false;
+    chip8_set_quirk(&chip8, 1, false);
 
     // Check most significant bit 0
     chip8.PC = chip8.pc_start_addr;
@@ -547,7 +626,7 @@ void test_8xyE()
     assert(chip8.V[6] == 0xE0);
     assert(chip8.V[0x0F] == 0x01);
 
-    chip8.quirks[1] = true;
+    chip8_set_quirk(&chip8, 1, true);
     chip8_reset(&chip8);
 }
 
@@ -588,20 +667,32 @@ void test_Bnnn()
     assert(chip8.PC == 0xC16);
 
     // Disable S-CHIP quirk
-    chip8.quirks[3] = false;
+    chip8_set_quirk(&chip8, 3, false);
     chip8.PC = chip8.pc_start_addr;
     chip8.V[0] = 0x69;
     chip8.V[0xB] = 0x42;
     chip8_execute(&chip8);
     assert(chip8.PC == 0xC16);
 
-    chip8.quirks[3] = true;
+    chip8_set_quirk(&chip8, 3, true);
     chip8_reset(&chip8);
 }
 
 void test_Cxkk()
 {
-    // This instruction generates a random byte, thus is hard to test.
+    chip8_load_instr(&chip8, 0xC60F);
+
+    // The same seed gives the same bytes.
+    chip8_seed(&chip8, 42);
+    chip8_execute(&chip8);
+    uint8_t first = chip8.V[6];
+    assert(first <= 0x0F);
+
+    chip8.PC = chip8.pc_start_addr;
+    chip8_seed(&chip8, 42);
+    chip8_execute(&chip8);
+    assert(chip8.V[6] == first);
+
     chip8_reset(&chip8);
 }
 
@@ -619,7 +710,7 @@ void test_Dxyn()
     {
         for (int x = 0; x < 6; x++)
         {
-            chip8.display[y][x] = true;
+            chip8_set_pixel(&chip8, BP1, x, y, true);
         }
     }
 
@@ -640,18 +731,52 @@ void test_Dxyn()
         {
             if (y < 4 || x < 4)
             {
-                assert(chip8.display[y][x]);
+                assert(chip8_get_pixel(&chip8, BP1, x, y));
             }
             else
             {
-                assert(!chip8.display[y][x]);
+                assert(!chip8_get_pixel(&chip8, BP1, x, y));
             }
         }
     }
-    assert(chip8.display[6][6]);
+    assert(chip8_get_pixel(&chip8, BP1, 6, 6));
     assert(chip8.V[0xF] == 1);
 
     chip8_reset(&chip8);
+
+    // 16x16 sprite on both planes in hires mode, counting colliding rows.
+    chip8_load_instr(&chip8, 0xD120);
+    chip8_set_quirk(&chip8, 8, false);
+    chip8.hires = true;
+    chip8.bitplane = BPBOTH;
+
+    chip8_set_pixel(&chip8, BP1, 20, 10, true);
+    chip8_set_pixel(&chip8, BP2, 35, 11, true);
+
+    for (int i = 0; i < 64; i++)
+    {
+        chip8.RAM[0x300 + i] = (i < 32) ? 0xFF : 0x0F;
+    }
+
+    chip8.I = 0x300;
+    chip8.V[1] = 20;
+    chip8.V[2] = 10;
+
+    chip8_execute(&chip8);
+
+    assert(!chip8_get_pixel(&chip8, BP1, 20, 10));
+    assert(chip8_get_pixel(&chip8, BP1, 21, 10));
+    assert(chip8_get_pixel(&chip8, BP1, 35, 25));
+    assert(!chip8_get_pixel(&chip8, BP1, 36, 10));
+    assert(!chip8_get_pixel(&chip8, BP1, 20, 26));
+    assert(chip8_get_pixel(&chip8, BP2, 24, 10));
+    assert(!chip8_get_pixel(&chip8, BP2, 23, 10));
+    assert(!chip8_get_pixel(&chip8, BP2, 35, 11));
+    assert(chip8_get_pixel(&chip8, BP2, 35, 12));
+    assert(chip8.V[0xF] == 2);
+
+    chip8_set_quirk(&chip8, 8, true);
+    chip8_reset(&chip8);
 }
 
 void test_Ex9E()
@@ -758,6 +883,14 @@ void test_Fx07()
     chip8_execute(&chip8);
     assert(chip8.V[0] == 0x42);
 
+    // Timer ticks are only counted until DT is read.
+    chip8.PC = chip8.pc_start_addr;
+    chip8.total_cycle_time = chip8.timer_max_cum * 3;
+    chip8_handle_timers(&chip8);
+    assert(chip8.DT == 0x42);
+    chip8_execute(&chip8);
+    assert(chip8.V[0] == 0x3F);
+
     chip8_reset(&chip8);
 }
 
@@ -768,10 +901,13 @@ void test_Fx0A()
     chip8.keypad[0xA] = KEY_DOWN;
     chip8_execute(&chip8);
     assert(chip8.PC == chip8.pc_start_addr);
+    assert(chip8_is_waiting(&chip8));
 
     chip8.keypad[0xA] = KEY_RELEASED;
+    assert(!chip8_is_waiting(&chip8));
     chip8_execute(&chip8);
     assert(chip8.PC == chip8.pc_start_addr + 2 && chip8.V[0] == 0xA);
+    assert(!chip8.waiting);
 
     chip8_reset(&chip8);
 }
@@ -784,6 +920,15 @@ void test_Fx15()
     chip8_execute(&chip8);
     assert(chip8.DT == 0x69);
 
+    // Ticks owed to the old value are not taken from the new one.
+    chip8.PC = chip8.pc_start_addr;
+    chip8.ST = 5;
+    chip8.total_cycle_time = chip8.timer_max_cum * 2;
+    chip8_handle_timers(&chip8);
+    chip8_execute(&chip8);
+    chip8_sync_timers(&chip8);
+    assert(chip8.DT == 0x69 && chip8.ST == 3 && chip8.beep);
+
     chip8_reset(&chip8);
 }
 
@@ -893,12 +1038,12 @@ void test_Fx55()
     assert(chip8.I == before_I);
 
     // Disable S-CHIP quirk for this instruction
-    chip8.quirks[2] = false;
+    chip8_set_quirk(&chip8, 2, false);
     chip8.PC = chip8.pc_start_addr;
     chip8_execute(&chip8);
     assert(chip8.I == before_I + 3);
 
-    chip8.quirks[2] = true;
+    chip8_set_quirk(&chip8, 2, true);
     chip8_reset(&chip8);
 }
 
@@ -918,12 +1063,12 @@ void test_Fx65()
     assert(chip8.I == before_I);
 
     // Disable S-CHIP quirk for this instruction
-    chip8.quirks[2] = false;
+    chip8_set_quirk(&chip8, 2, false);
     chip8.PC = chip8.pc_start_addr;
     chip8_execute(&chip8);
     assert(chip8.I == before_I + 3);
 
-    chip8.quirks[2] = true;
+    chip8_set_quirk(&chip8, 2, true);
     chip8_reset(&chip8);
 }
 
@@ -951,6 +1096,233 @@ void test_Fx75_Fx85()
     chip8_reset(&chip8);
 }
 
+void test_execute_block()
+{
+    // Stores 0x70 over the first byte of the instruction at 0x206 (6005).
+    uint16_t program[] = {0xA206, 0x6070, 0xF055, 0x6005, 0x1200};
+    load_program(&chip8, program, sizeof(program) / sizeof(program[0]));
+
+    // The block is cut short once it overwrites itself.
+    assert(chip8_execute_block(&chip8, 100) == 3);
+    assert(chip8.PC == chip8.pc_start_addr + 6);
+
+    // The modified instruction (7005) runs, then the block ends at the jump.
+    assert(chip8_execute_block(&chip8, 100) == 2);
+    assert(chip8.V[0] == 0x75);
+    assert(chip8.PC == chip8.pc_start_addr);
+
+    // Blocks never run more than requested.
+    assert(chip8_execute_block(&chip8, 2) == 2);
+    assert(chip8.PC == chip8.pc_start_addr + 4);
+
+    chip8_reset(&chip8);
+}
+
+void test_run()
+{
+    uint16_t program[] = {0x6001, 0x7001, 0x00E0, 0x7001, 0xF10A, 0x1200};
+    load_program(&chip8, program, sizeof(program) / sizeof(program[0]));
+
+    // Stops as soon as Fx0A is waiting for a key.
+    assert(chip8_run(&chip8, 100, false) == 5);
+    assert(chip8.V[0] == 3);
+    assert(chip8.PC == chip8.pc_start_addr + 8);
+
+    // Stops after clearing the display when asked to.
+    chip8.PC = chip8.pc_start_addr;
+    chip8.waiting = false;
+    assert(chip8_run(&chip8, 100, true) == 3);
+    assert(chip8.display_changed);
+    assert(chip8.PC == chip8.pc_start_addr + 6);
+
+    // Carries on until the next Fx0A once a key is released.
+    chip8.PC = chip8.pc_start_addr + 8;
+    chip8.keypad[5] = KEY_RELEASED;
+    assert(chip8_run(&chip8, 100, false) == 7);
+    assert(chip8.V[1] == 5);
+
+    chip8_reset(&chip8);
+}
+
+void test_run_idle_loop()
+{
+    uint16_t program[] = {0xF007, 0x3000, 0x1200};
+    load_program(&chip8, program, sizeof(program) / sizeof(program[0]));
+
+    // Ends up exactly where running every instruction would have.
+    chip8.DT = 5;
+    assert(chip8_run(&chip8, 100, false) == 100);
+    assert(chip8.V[0] == 5);
+    assert(chip8.PC == chip8.pc_start_addr + 2);
+    assert(chip8.skipped_cycles > 0 && chip8.skipped_cycles < 100);
+
+    // Leaves the loop once the timer runs out.
+    chip8.DT = 0;
+    assert(chip8_run(&chip8, 4, false) == 4);
+    assert(chip8.V[0] == 0);
+    assert(chip8.PC == chip8.pc_start_addr + 6);
+
+    chip8_reset(&chip8);
+}
+
+void test_dirty_rows()
+{
+    chip8_load_instr(&chip8, 0xD013);
+    chip8.I = 0x300;
+    chip8.V[0] = 0;
+    chip8.V[1] = 5;
+    chip8.RAM[0x300] = 0xFF;
+
+    // Lores rows cover two display rows.
+    chip8_clear_dirty_rows(&chip8);
+    chip8_execute(&chip8);
+    assert(chip8_get_dirty_rows(&chip8) == (0x3FULL << 10));
+
+    chip8_clear_dirty_rows(&chip8);
+    chip8.hires = true;
+    chip8.PC = chip8.pc_start_addr;
+    chip8_execute(&chip8);
+    assert(chip8_get_dirty_rows(&chip8) == (0x7ULL << 5));
+
+    chip8_clear_dirty_rows(&chip8);
+    chip8_scroll(&chip8, 1, 0, 4, BP1);
+    assert(chip8_get_dirty_rows(&chip8) == DISPLAY_ALL_ROWS);
+
+    chip8_clear_dirty_rows(&chip8);
+    chip8_set_pixel(&chip8, BP2, 3, 63, true);
+    assert(chip8_get_dirty_rows(&chip8) == (1ULL << 63));
+
+    chip8_reset(&chip8);
+    assert(chip8_get_dirty_rows(&chip8) == DISPLAY_ALL_ROWS);
+}
+
+void test_dead_vf()
+{
+    // The first draw's VF is overwritten by 6F07, the second's is read.
+    uint16_t program[] = {0xD011, 0x6F07, 0xD011, 0x3F01, 0x1200};
+    load_program(&chip8, program, sizeof(program) / sizeof(program[0]));
+
+    chip8.I = 0x300;
+    chip8.RAM[0x300] = 0x80;
+    chip8.V[0] = 3;
+    chip8.V[1] = 4;
+    chip8_set_pixel(&chip8, BP1, 6, 8, true);
+    chip8_set_pixel(&chip8, BP1, 7, 9, true);
+
+    // Stopping before 6F07 still leaves the collision in VF.
+    assert(chip8_run(&chip8, 1, false) == 1);
+    assert(!chip8_get_pixel(&chip8, BP1, 6, 8));
+    assert(chip8.V[0xF] == 1);
+
+    assert(chip8_run(&chip8, 1, false) == 1);
+    assert(chip8.V[0xF] == 7);
+
+    assert(chip8_run(&chip8, 2, false) == 2);
+    assert(chip8_get_pixel(&chip8, BP1, 6, 8));
+    assert(chip8.V[0xF] == 1);
+    assert(chip8.PC == chip8.pc_start_addr + 10);
+
+    // Running the whole block skips the first collision check only.
+    uint16_t addr = chip8.pc_start_addr;
+    chip8.PC = addr;
+    assert(chip8_run(&chip8, 3, false) == 3);
+    assert(chip8_get_pixel(&chip8, BP1, 6, 8));
+    assert(chip8.V[0xF] == 1);
+    assert(chip8.icache->instr[addr].op != chip8.icache->instr[addr + 4].op);
+
+    // Still stops right after the first draw when asked to.
+    chip8.PC = addr;
+    assert(chip8_run(&chip8, 100, true) == 1);
+    assert(chip8.PC == addr + 2);
+    assert(chip8.V[0xF] == 1);
+
+    chip8_reset(&chip8);
+}
+
+void test_dead_flags()
+{
+    // The first carry is overwritten by 6F07 before anything reads it.
+    uint16_t program[] = {0x8014, 0x6F07, 0x8014, 0x8011, 0x3F01, 0x1200};
+    load_program(&chip8, program, sizeof(program) / sizeof(program[0]));
+
+    chip8.V[0] = 0xFF;
+    chip8.V[1] = 0x02;
+    assert(chip8_run(&chip8, 1, false) == 1);
+    assert(chip8.V[0] == 0x01 && chip8.V[0xF] == 1);
+    assert(chip8_run(&chip8, 1, false) == 1);
+    assert(chip8.V[0xF] == 7);
+
+    // Quirk 9 disabled: 8011 resets VF, so the carry is dead again.
+    chip8.V[0] = 0xFF;
+    assert(chip8_run(&chip8, 2, false) == 2);
+    assert(chip8.V[0] == 0x03 && chip8.V[0xF] == 0);
+
+    // Quirk 9 enabled: 8011 leaves VF alone for 3F01 to read the carry.
+    chip8_set_quirk(&chip8, 9, true);
+    chip8.PC = chip8.pc_start_addr + 4;
+    chip8.V[0] = 0xFF;
+    assert(chip8_run(&chip8, 2, false) == 2);
+    assert(chip8.V[0] == 0x03 && chip8.V[0xF] == 1);
+    assert(chip8_run(&chip8, 1, false) == 1);
+    assert(chip8.PC == chip8.pc_start_addr + 12);
+
+    // Only the first carry is skipped when the whole block runs.
+    uint16_t addr = chip8.pc_start_addr;
+    chip8.PC = addr;
+    chip8.V[0] = 0xFF;
+    assert(chip8_run(&chip8, 5, false) == 5);
+    assert(chip8.V[0] == 0x03 && chip8.V[0xF] == 0);
+    assert(chip8.icache->instr[addr].op != chip8.icache->instr[addr + 4].op);
+
+    chip8_set_quirk(&chip8, 9, false);
+    chip8_reset(&chip8);
+}
+
+void test_run_frame()
+{
+    uint16_t program[] = {0x7001, 0x1200};
+    load_program(&chip8, program, sizeof(program) / sizeof(program[0]));
+
+    // The remainder of cpu_freq / refresh_freq is spread over the frames.
+    unsigned long cycles = 0;
+    for (unsigned long i = 0; i < chip8.refresh_freq; i++)
+    {
+        cycles += chip8_frame_cycles(&chip8);
+    }
+    assert(cycles == chip8.cpu_freq);
+
+    // IPF mode ticks the timers once per frame whatever their frequency.
+    chip8_set_ipf(&chip8, 15);
+    chip8_set_timer_freq(&chip8, TIMER_FREQ_DEFAULT * 2);
+    chip8.DT = 5;
+    chip8.ST = 1;
+    assert(chip8_frame_cycles(&chip8) == 15);
+    assert(chip8_run_frame(&chip8, chip8_frame_cycles(&chip8)) == 15);
+    assert(chip8.DT == 4 && chip8.ST == 0 && chip8.beep);
+    assert(chip8_run_frame(&chip8, 15) == 15);
+    assert(chip8.DT == 3 && !chip8.beep);
+
+    chip8_set_timer_freq(&chip8, TIMER_FREQ_DEFAULT);
+    chip8_set_ipf(&chip8, 0);
+    chip8_reset(&chip8);
+}
+
+void test_calibrate()
+{
+    uint16_t program[] = {0x7001, 0x1200};
+    load_program(&chip8, program, sizeof(program) / sizeof(program[0]));
+
+    // Calibration runs a copy, so the machine itself is left as it was.
+    CHIP8_CALIBRATION cal;
+    assert(chip8_calibrate(&chip8, 0.01, CALIBRATION_HEADROOM_DEFAULT, &cal));
+    assert(cal.instructions > 0 && cal.ipf >= 1);
+    assert(cal.cpu_freq == cal.ipf * chip8.refresh_freq);
+    assert(chip8.PC == chip8.pc_start_addr && chip8.V[0] == 0);
+    assert(chip8.cpu_freq == CPU_FREQ_DEFAULT && !chip8.ipf);
+
+    chip8_reset(&chip8);
+}
+
 int main()
 {
     bool quirks[NUM_QUIRKS] = {1, 1, 1, 1, 1, 1, 1, 1, 1};
@@ -1015,6 +1387,14 @@ int main()
     test_Fx55();
     test_Fx65();
     test_Fx75_Fx85();
+    test_execute_block();
+    test_run();
+    test_run_idle_loop();
+    test_dirty_rows();
+    test_dead_vf();
+    test_dead_flags();
+    test_run_frame();
+    test_calibrate();
 
     printf("All tests pass!\n");
 